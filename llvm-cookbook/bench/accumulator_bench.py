@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Times an accumulator written as a recursion and as a loop over a var.
+
+Both programs sum 1..N, --repeat times, and must evaluate to the same value.
+The run time is the execute phase of the toy's -time-report.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+ACCUMULATORS = {
+    "recursive":
+        "def sum(n acc) if n < 1 then acc else sum(n - 1, acc + n);\n"
+        "def total(n) sum(n, 0);\n",
+    "loop":
+        "def total(n) var acc in (for i = 1, i < n in acc = acc + i) + acc;\n",
+}
+
+DRIVER = ("def run(n r) var t in (for k = 1, k < r in t = t + total(n)) + t;\n"
+          "run(%d, %d);\n")
+
+
+def run(opts, source, flags):
+    with tempfile.NamedTemporaryFile(suffix=".json") as report:
+        output = subprocess.run(
+            [opts.toy, "-print-ir=false", "-time-report", "-report-json",
+             "-info-output-file=" + report.name, source] + flags,
+            stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout
+        seconds = json.load(report)["phase_seconds"]["execute"]
+    return output.strip(), seconds
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--toy", default=os.path.join(HERE, "../chapter3/toy"))
+    parser.add_argument("--n", type=int, default=10000,
+                        help="length of the sum, and depth of the recursion")
+    parser.add_argument("--repeat", type=int, default=1000)
+    opts = parser.parse_args()
+
+    configs = [["-O0"], ["-O2"], ["-O2", "-tiered"]]
+    print("%-10s %-12s %10s" % ("form", "flags", "run ms"))
+    with tempfile.TemporaryDirectory() as tmp:
+        outputs = set()
+        for form, definition in ACCUMULATORS.items():
+            source = os.path.join(tmp, form + ".toy")
+            with open(source, "w") as out:
+                out.write(definition + DRIVER % (opts.n, opts.repeat))
+
+            for flags in configs:
+                output, seconds = run(opts, source, flags)
+                outputs.add(output)
+                print("%-10s %-12s %10.2f" % (form, " ".join(flags),
+                                              seconds * 1e3))
+
+        if len(outputs) != 1:
+            raise SystemExit("forms disagree: %s" % sorted(outputs))
+
+
+if __name__ == "__main__":
+    main()
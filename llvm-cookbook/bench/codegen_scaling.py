@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+"""Times chapter3 toy on a generated program with 1..N codegen threads."""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--toy", default=os.path.join(HERE, "../chapter3/toy"))
+    parser.add_argument("--defs", type=int, default=10000)
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count())
+    opts = parser.parse_args()
+
+    # Threads beyond the core count only add scheduling noise, so a speedup
+    # column from a single-core machine says nothing about scaling.
+    if (os.cpu_count() or 1) < 2:
+        print("warning: only one core; speedups do not measure scaling",
+              file=sys.stderr)
+
+    with tempfile.NamedTemporaryFile("w", suffix=".toy") as source:
+        subprocess.run([sys.executable, os.path.join(HERE, "gen_toy.py"),
+                        "--defs", str(opts.defs)], stdout=source, check=True)
+        source.flush()
+
+        print("%-8s %10s %8s" % ("threads", "seconds", "speedup"))
+        threads, baseline = 1, None
+        while threads <= opts.max_threads:
+            start = time.perf_counter()
+            subprocess.run([opts.toy, "-j%d" % threads, "-print-ir=false",
+                            source.name], stdout=subprocess.DEVNULL, check=True)
+            elapsed = time.perf_counter() - start
+            baseline = baseline or elapsed
+            print("%-8d %10.3f %7.2fx" % (threads, elapsed, baseline / elapsed))
+            threads *= 2
+
+
+if __name__ == "__main__":
+    main()
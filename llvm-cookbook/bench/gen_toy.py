@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Writes a synthetic toy program to stdout.
+
+Modes:
+  defs   many definitions with random expression trees that call earlier ones
+  deep   few definitions, each one right-nested chain of --depth operators,
+         at most MAX_CHAIN_DEPTH deep
+  ops    user-defined binary and unary operators used throughout the trees
+  loops  definitions made of --depth nested for loops of --trip iterations
+"""
+
+import argparse
+import random
+
+# The toy parses, generates and simplifies expressions recursively, one frame
+# per level, so deeper chains overflow the 8 MB default stack of unoptimized
+# builds.
+MAX_CHAIN_DEPTH = 2000
+
+# Operators defined by --mode ops, with the definitions that implement them.
+USER_OPERATORS = [
+    "def binary | 5 (a b) if a then 1 else if b then 1 else 0",
+    "def binary & 6 (a b) if a then if b then 1 else 0 else 0",
+    "def binary > 10 (a b) b < a",
+    "def unary ! (v) if v then 0 else 1",
+    "def unary ~ (v) 0 - v",
+]
+
+
+def expression(rng, depth, args, callees, binops="+-*<", unops=""):
+    if depth == 0:
+        if rng.random() < 0.5:
+            leaf = rng.choice(args)
+        else:
+            leaf = str(rng.randint(0, 99))
+        if unops and rng.random() < 0.2:
+            return rng.choice(unops) + leaf
+        return leaf
+
+    if callees and rng.random() < 0.1:
+        callee, arity = rng.choice(callees)
+        call_args = [expression(rng, depth - 1, args, [], binops, unops)
+                     for _ in range(arity)]
+        return "%s(%s)" % (callee, ", ".join(call_args))
+
+    op = rng.choice(binops)
+    return "(%s %s %s)" % (
+        expression(rng, depth - 1, args, callees, binops, unops), op,
+        expression(rng, depth - 1, args, callees, binops, unops))
+
+
+def chain(rng, depth, args):
+    # Built iteratively: the parser recurses once per level, Python need not.
+    parts = []
+    for _ in range(depth):
+        term = rng.choice(args + [str(rng.randint(0, 99))])
+        parts.append("(%s %s " % (term, rng.choice("+-*<")))
+    return "".join(parts) + rng.choice(args) + ")" * depth
+
+
+def loops(rng, depth, body_depth):
+    variables = ["i%d" % level for level in range(depth)]
+    headers = ["for %s = 0, %s < n in " % (v, v) for v in variables]
+    return "".join(headers) + expression(rng, body_depth, ["n"] + variables, [])
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--mode", choices=["defs", "deep", "ops", "loops"],
+                        default="defs")
+    parser.add_argument("--defs", type=int, default=1000,
+                        help="number of function definitions")
+    parser.add_argument("--depth", type=int, default=6,
+                        help="depth of each definition's expression tree, "
+                             "chain or loop nest")
+    parser.add_argument("--trip", type=int, default=100,
+                        help="trip count passed to loop definitions")
+    parser.add_argument("--calls", type=int, default=0,
+                        help="top-level calls of the first definitions, so "
+                             "the program also runs")
+    parser.add_argument("--seed", type=int, default=1)
+    opts = parser.parse_args()
+    if opts.mode == "deep" and opts.depth > MAX_CHAIN_DEPTH:
+        parser.error("--depth of a deep chain is limited to %d"
+                     % MAX_CHAIN_DEPTH)
+
+    rng = random.Random(opts.seed)
+    binops, unops = "+-*<", ""
+    if opts.mode == "ops":
+        for definition in USER_OPERATORS:
+            print(definition)
+        binops, unops = "+-*<|&>", "!~"
+
+    callees = []
+    for i in range(opts.defs):
+        if opts.mode == "loops":
+            name, args = "loop%d" % i, ["n"]
+            body = loops(rng, opts.depth, 3)
+        else:
+            name, args = "f%d" % i, ["a", "b", "c"]
+            if opts.mode == "deep":
+                body = chain(rng, opts.depth, args)
+            else:
+                body = expression(rng, opts.depth, args, callees[-16:],
+                                  binops, unops)
+        print("def %s(%s)" % (name, " ".join(args)))
+        print("  " + body)
+        callees.append((name, len(args)))
+
+    # Only the first definitions are called: every definition may call the
+    # ones before it, so the cost of a call grows quickly with its index.
+    for name, arity in callees[:opts.calls]:
+        if opts.mode == "loops":
+            call_args = [str(opts.trip)]
+        else:
+            call_args = [str(rng.randint(0, 99)) for _ in range(arity)]
+        print("%s(%s);" % (name, ", ".join(call_args)))
+
+
+if __name__ == "__main__":
+    main()
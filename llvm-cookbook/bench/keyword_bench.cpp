@@ -0,0 +1,86 @@
+// Per-identifier cost of keyword recognition: the sequential string compares
+// the lexers used to do against the constexpr perfect-hash table.
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "toy_keywords.h"
+
+static Toy_Keyword sequential_keyword(const std::string &S) {
+  if (S == "def") return KW_DEF;
+  if (S == "if") return KW_IF;
+  if (S == "then") return KW_THEN;
+  if (S == "else") return KW_ELSE;
+  if (S == "for") return KW_FOR;
+  if (S == "in") return KW_IN;
+  if (S == "binary") return KW_BINARY;
+  if (S == "unary") return KW_UNARY;
+  return KW_NONE;
+}
+
+static std::vector<std::string> make_identifiers(unsigned Count,
+                                                 unsigned KeywordPercent) {
+  std::mt19937 Rng(42);
+  std::uniform_int_distribution<unsigned> Percent(0, 99);
+  std::uniform_int_distribution<unsigned> Length(1, 10);
+  std::uniform_int_distribution<unsigned> Letter(0, 25);
+  std::uniform_int_distribution<unsigned> Keyword(
+      0, sizeof(Keywords) / sizeof(Keywords[0]) - 1);
+
+  std::vector<std::string> Identifiers;
+  Identifiers.reserve(Count);
+  for (unsigned i = 0; i != Count; ++i) {
+    if (Percent(Rng) < KeywordPercent) {
+      Identifiers.emplace_back(Keywords[Keyword(Rng)].Name);
+      continue;
+    }
+    std::string Name;
+    for (unsigned j = 0, e = Length(Rng); j != e; ++j)
+      Name += (char)('a' + Letter(Rng));
+    Identifiers.push_back(Name);
+  }
+  return Identifiers;
+}
+
+template <typename Classify>
+static double ns_per_identifier(const std::vector<std::string> &Identifiers,
+                                unsigned Rounds, Classify classify) {
+  unsigned Sink = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (unsigned r = 0; r != Rounds; ++r)
+    for (const std::string &S : Identifiers) Sink += classify(S);
+  auto Stop = std::chrono::steady_clock::now();
+
+  // Keep the loop from being optimized away.
+  if (Sink == 0xdeadbeef) std::printf(" ");
+
+  std::chrono::duration<double, std::nano> Elapsed = Stop - Start;
+  return Elapsed.count() / ((double)Identifiers.size() * Rounds);
+}
+
+int main() {
+  const unsigned Count = 1 << 20;
+  const unsigned Rounds = 20;
+
+  std::printf("%-18s %14s %14s\n", "input", "sequential ns", "hashed ns");
+  for (auto [Label, KeywordPercent] :
+       {std::pair<const char *, unsigned>{"keyword-heavy", 80},
+        std::pair<const char *, unsigned>{"identifier-heavy", 5}}) {
+    std::vector<std::string> Identifiers =
+        make_identifiers(Count, KeywordPercent);
+
+    double Sequential =
+        ns_per_identifier(Identifiers, Rounds, [](const std::string &S) {
+          return sequential_keyword(S);
+        });
+    double Hashed =
+        ns_per_identifier(Identifiers, Rounds, [](const std::string &S) {
+          return lookup_keyword(S);
+        });
+    std::printf("%-18s %14.2f %14.2f\n", Label, Sequential, Hashed);
+  }
+  return 0;
+}
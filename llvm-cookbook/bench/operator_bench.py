@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Times a loop over user-defined operators, called or inlined.
+
+The operators are the ones of gen_toy.py --mode ops plus a power operator
+with a loop of its own. With -inline-operator-size=0 every use is a call;
+by default the toy inlines them into the loop before code generation. All
+runs must evaluate to the same value. The run time is the execute phase of
+the toy's -time-report.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import tempfile
+
+from gen_toy import USER_OPERATORS
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+PROGRAM = "\n".join(USER_OPERATORS + [
+    "def binary : 1 (x y) y",
+    "def binary ^ 15 (a b) var r = 1 in (for i = 1, i < b in r = r * a) : r",
+    "def mix(i) (i & 1 | i & 2 | !(i > 5)) + ~(i ^ 3) + (i > 7 & !(i < 100))",
+    "def run(n) var t in (for i = 0, i < n in t = t + mix(i)) : t",
+    "run(%d);",
+]) + "\n"
+
+CONFIGS = [
+    ("called", ["-O2", "-inline-operator-size=0"]),
+    ("inlined", ["-O2"]),
+    ("called", ["-O2", "-tiered", "-inline-operator-size=0"]),
+    ("inlined", ["-O2", "-tiered"]),
+]
+
+
+def run(opts, source, flags):
+    with tempfile.NamedTemporaryFile(suffix=".json") as report:
+        output = subprocess.run(
+            [opts.toy, "-print-ir=false", "-time-report", "-report-json",
+             "-info-output-file=" + report.name, source] + flags,
+            stdout=subprocess.PIPE, universal_newlines=True, check=True).stdout
+        seconds = json.load(report)["phase_seconds"]["execute"]
+    return output.strip(), seconds
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--toy", default=os.path.join(HERE, "../chapter3/toy"))
+    parser.add_argument("--n", type=int, default=1000000,
+                        help="iterations of the loop over the operators")
+    opts = parser.parse_args()
+
+    print("%-8s %-36s %10s" % ("ops", "flags", "run ms"))
+    with tempfile.TemporaryDirectory() as tmp:
+        source = os.path.join(tmp, "operators.toy")
+        with open(source, "w") as out:
+            out.write(PROGRAM % opts.n)
+
+        outputs = set()
+        for form, flags in CONFIGS:
+            output, seconds = run(opts, source, flags)
+            outputs.add(output)
+            print("%-8s %-36s %10.2f" % (form, " ".join(flags),
+                                         seconds * 1e3))
+
+        if len(outputs) != 1:
+            raise SystemExit("runs disagree: %s" % sorted(outputs))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Measures chapter3 toy on generated workloads of several sizes.
+
+For every workload and size it reports:
+  lines/s  compile throughput of -c, which builds machine code for every
+           definition and writes it to /dev/null
+  jit ms   time the JIT spends compiling while the program runs
+  run ms   time spent running top-level expressions, without the JIT
+Both run-time numbers come from the toy's own -time-report.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from gen_toy import MAX_CHAIN_DEPTH
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# gen_toy.py arguments of every workload for a given size.
+WORKLOADS = {
+    "defs": lambda n: ["--mode", "defs", "--defs", n, "--calls", 4],
+    "deep": lambda n: ["--mode", "deep", "--defs", 10, "--depth", n,
+                       "--calls", 4],
+    "ops": lambda n: ["--mode", "ops", "--defs", n, "--calls", 4],
+    "loops": lambda n: ["--mode", "loops", "--defs", n, "--depth", 2,
+                        "--trip", 300, "--calls", 4],
+}
+
+
+def generate(workload, size, path):
+    args = [str(arg) for arg in WORKLOADS[workload](size)]
+    with open(path, "w") as out:
+        subprocess.run([sys.executable, os.path.join(HERE, "gen_toy.py")] + args,
+                       stdout=out, check=True)
+    with open(path) as source:
+        return sum(1 for _ in source)
+
+
+def measure(opts, source, lines):
+    toy = [opts.toy, "-O%d" % opts.opt, "-print-ir=false"]
+
+    start = time.perf_counter()
+    subprocess.run(toy + ["-c", "-o", os.devnull, source],
+                   stdout=subprocess.DEVNULL, check=True)
+    compile_seconds = time.perf_counter() - start
+
+    with tempfile.NamedTemporaryFile(suffix=".json") as report:
+        subprocess.run(toy + ["-time-report", "-report-json",
+                              "-info-output-file=" + report.name, source],
+                       stdout=subprocess.DEVNULL, check=True)
+        phases = json.load(report)["phase_seconds"]
+
+    return {
+        "lines": lines,
+        "lines_per_second": lines / compile_seconds,
+        "jit_ms": phases["jit"] * 1e3,
+        "run_ms": phases["execute"] * 1e3,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--toy", default=os.path.join(HERE, "../chapter3/toy"))
+    parser.add_argument("--workloads", default=",".join(WORKLOADS))
+    parser.add_argument("--sizes", default="100,1000,10000",
+                        help="definitions, or chain depth for deep")
+    parser.add_argument("--opt", type=int, default=2,
+                        help="optimization level passed to the toy")
+    parser.add_argument("--json", help="also write the results to this file")
+    opts = parser.parse_args()
+
+    results = []
+    print("%-6s %7s %8s %12s %10s %10s" %
+          ("mode", "size", "lines", "lines/s", "jit ms", "run ms"))
+    with tempfile.TemporaryDirectory() as tmp:
+        for workload in opts.workloads.split(","):
+            for size in [int(s) for s in opts.sizes.split(",")]:
+                if workload == "deep" and size > MAX_CHAIN_DEPTH:
+                    print("%-6s %7d  skipped, deeper than %d" %
+                          (workload, size, MAX_CHAIN_DEPTH))
+                    continue
+                source = os.path.join(tmp, "%s_%d.toy" % (workload, size))
+                lines = generate(workload, size, source)
+                result = measure(opts, source, lines)
+                result.update(workload=workload, size=size)
+                results.append(result)
+                print("%-6s %7d %8d %12.0f %10.2f %10.2f" %
+                      (workload, size, lines, result["lines_per_second"],
+                       result["jit_ms"], result["run_ms"]))
+
+    if opts.json:
+        with open(opts.json, "w") as out:
+            json.dump({"opt_level": opts.opt, "results": results}, out,
+                      indent=2)
+
+
+if __name__ == "__main__":
+    main()
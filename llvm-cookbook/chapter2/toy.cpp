@@ -13,6 +13,8 @@
 #include <string>
 #include <vector>
 
+#include "toy_keywords.h"
+
 using namespace llvm;
 
 // =======================
@@ -43,7 +45,7 @@ static int get_token() {
     Identifier_string = LastChar;
     while (isalnum((LastChar = fgetc(file)))) Identifier_string += LastChar;
 
-    if (Identifier_string == "def") return DEF_TOKEN;
+    if (lookup_keyword(Identifier_string) == KW_DEF) return DEF_TOKEN;
 
     return IDENTIFIER_TOKEN;
   }
@@ -99,11 +101,11 @@ class VariableAST : public BaseAST {
 };
 
 class BinaryAST : public BaseAST {
-  std::string Bin_Operator;
+  char Bin_Operator;
   BaseAST *LHS, *RHS;
 
  public:
-  BinaryAST(std::string op, BaseAST *lhs, BaseAST *rhs)
+  BinaryAST(char op, BaseAST *lhs, BaseAST *rhs)
       : Bin_Operator(op), LHS(lhs), RHS(rhs) {}
   Value *Codegen() override;
 };
@@ -219,7 +221,7 @@ static BaseAST *binary_op_parser(int Old_Prec, BaseAST *LHS) {
 
     if (Operator_Prec < Old_Prec) return LHS;
 
-    int BinOp = Current_token;
+    char BinOp = Current_token;
     next_token();  // eat binary operator
 
     BaseAST *RHS = base_parser();
@@ -231,7 +233,7 @@ static BaseAST *binary_op_parser(int Old_Prec, BaseAST *LHS) {
       if (!RHS) return nullptr;
     }
 
-    LHS = new BinaryAST(std::to_string(BinOp), LHS, RHS);
+    LHS = new BinaryAST(BinOp, LHS, RHS);
   }
 }
 
@@ -302,7 +304,7 @@ Value *BinaryAST::Codegen() {
   Value *R = RHS->Codegen();
   if (!L || !R) return nullptr;
 
-  switch (std::stoi(Bin_Operator)) {
+  switch (Bin_Operator) {
     case '+':
       return Builder.CreateAdd(L, R, "addtmp");
     case '-':
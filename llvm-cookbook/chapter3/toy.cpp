@@ -1,21 +1,223 @@
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/PassTimingInfo.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
-
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/PassPlugin.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Host.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/IndVarSimplify.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopDeletion.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/LoopRotation.h>
+#include <llvm/Transforms/Scalar/LoopUnrollPass.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
-#include <cstdio>
+#include <chrono>
+#include <climits>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include "toy_compiler.h"
+#include "toy_keywords.h"
+
 using namespace llvm;
 
+// =======================
+// Instrumentation
+// =======================
+
+static cl::opt<bool> TimeReport(
+    "time-report", cl::init(false),
+    cl::desc("Report the wall time spent in every compilation phase"));
+
+static cl::opt<bool> ReportJSON(
+    "report-json", cl::init(false),
+    cl::desc("Print -time-report and -stats as JSON"));
+
+enum Toy_Phase {
+  PHASE_LEX,
+  PHASE_PARSE,
+  PHASE_CODEGEN,
+  PHASE_VERIFY,
+  PHASE_OPTIMIZE,
+  PHASE_JIT,
+  PHASE_CACHE,
+  PHASE_EMIT,
+  PHASE_EXECUTE,
+  PHASE_COUNT,
+};
+
+static const char *const Phase_Names[PHASE_COUNT] = {
+    "lex", "parse", "codegen", "verify", "optimize",
+    "jit", "cache", "emit",    "execute",
+};
+
+// Exclusive wall time of every phase, summed over all threads: time spent in
+// a nested phase, like lexing inside parsing, is left out of the enclosing
+// one.
+static std::atomic<uint64_t> Phase_Nanoseconds[PHASE_COUNT];
+
+class Phase_Timer;
+static thread_local Phase_Timer *Current_Phase_Timer;
+
+class Phase_Timer {
+  Toy_Phase Phase;
+  bool Active;
+  Phase_Timer *Parent = nullptr;
+  uint64_t Nested_Nanoseconds = 0;
+  std::chrono::steady_clock::time_point Start;
+
+ public:
+  explicit Phase_Timer(Toy_Phase phase) : Phase(phase), Active(TimeReport) {
+    if (!Active) return;
+    Parent = Current_Phase_Timer;
+    Current_Phase_Timer = this;
+    Start = std::chrono::steady_clock::now();
+  }
+
+  ~Phase_Timer() {
+    if (!Active) return;
+    uint64_t Elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - Start)
+                           .count();
+    Phase_Nanoseconds[Phase] += Elapsed - Nested_Nanoseconds;
+    if (Parent) Parent->Nested_Nanoseconds += Elapsed;
+    Current_Phase_Timer = Parent;
+  }
+};
+
+// Counters reported by LLVM's -stats flag, summed over every session.
+static std::atomic<uint64_t> Num_Tokens;
+static std::atomic<uint64_t> Num_AST_Nodes;
+static std::atomic<uint64_t> Num_Constants_Folded;
+static std::atomic<uint64_t> Num_Operators_Inlined;
+static std::atomic<uint64_t> Num_IR_Instructions;
+static std::atomic<uint64_t> Num_Functions_Compiled;
+static std::atomic<uint64_t> Num_Functions_Cached;
+static std::atomic<uint64_t> Num_Machine_Code_Bytes;
+
+static unsigned count_functions(const Module &M) {
+  unsigned Functions = 0;
+  for (const Function &F : M)
+    if (!F.isDeclaration()) ++Functions;
+  return Functions;
+}
+
+// Objects loaded from -cache-dir count as neither compiled code nor jit
+// time.
+static void record_cached_object(const Module &M) {
+  Num_Functions_Cached += count_functions(M);
+}
+
+static void record_object(const Module &M, MemoryBufferRef Obj) {
+  Num_Functions_Compiled += count_functions(M);
+
+  if (!AreStatisticsEnabled()) return;
+  Expected<std::unique_ptr<object::ObjectFile>> File =
+      object::ObjectFile::createObjectFile(Obj);
+  if (!File) {
+    consumeError(File.takeError());
+    return;
+  }
+  for (const object::SectionRef &Section : (*File)->sections())
+    if (Section.isText()) Num_Machine_Code_Bytes += Section.getSize();
+}
+
+static void print_report(raw_ostream &OS, double Wall_Seconds) {
+  std::pair<const char *, uint64_t> Counters[] = {
+      {"tokens", Num_Tokens},
+      {"ast_nodes", Num_AST_Nodes},
+      {"constants_folded", Num_Constants_Folded},
+      {"operators_inlined", Num_Operators_Inlined},
+      {"ir_instructions", Num_IR_Instructions},
+      {"functions_compiled", Num_Functions_Compiled},
+      {"functions_cached", Num_Functions_Cached},
+      {"machine_code_bytes", Num_Machine_Code_Bytes},
+  };
+  auto Seconds = [](unsigned Phase) { return Phase_Nanoseconds[Phase] / 1e9; };
+
+  if (ReportJSON) {
+    json::OStream J(OS, 2);
+    J.object([&] {
+      J.attribute("wall_seconds", Wall_Seconds);
+      if (TimeReport)
+        J.attributeObject("phase_seconds", [&] {
+          for (unsigned P = 0; P != PHASE_COUNT; ++P)
+            J.attribute(Phase_Names[P], Seconds(P));
+        });
+      if (AreStatisticsEnabled())
+        J.attributeObject("counters", [&] {
+          for (const auto &[Name, Value] : Counters)
+            J.attribute(Name, (int64_t)Value);
+        });
+    });
+    OS << "\n";
+    return;
+  }
+
+  if (TimeReport) {
+    OS << "===--- Toy compilation phases (exclusive, all threads) ---===\n";
+    OS << format("  Total wall time: %.4f s\n\n", Wall_Seconds);
+    OS << "    Seconds  Phase\n";
+    for (unsigned P = 0; P != PHASE_COUNT; ++P)
+      OS << format("  %9.4f  ", Seconds(P)) << Phase_Names[P] << "\n";
+  }
+  if (AreStatisticsEnabled()) {
+    OS << "===--- Toy statistics ---===\n";
+    for (const auto &[Name, Value] : Counters)
+      OS << format("  %12llu  ", (unsigned long long)Value) << Name << "\n";
+  }
+}
+
 // =======================
 // Token
 // =======================
@@ -37,67 +239,153 @@ enum Token_Type {
 
   BINARY_TOKEN,
   UNARY_TOKEN,
+
+  VAR_TOKEN,
 };
 
-static FILE *file;
-static int Numeric_Val;
-static std::string Identifier_string;
+// A program is lexed and parsed start to finish on the thread that compiles
+// it, so the lexer and parser state is per thread.
+static thread_local std::unique_ptr<MemoryBuffer> Source;
+static thread_local const char *Cur_Ptr;
+static thread_local int Numeric_Val;
+static thread_local std::string_view Identifier_string;
+
+// Every token is a slice of the mapped source buffer, so the lexer never
+// copies identifiers or numbers.
+static thread_local std::string_view Token_Text;
+static thread_local size_t Token_Offset;
+
+// Hash of the tokens consumed since the current definition started, so a
+// definition is the same after its layout or comments change.
+static thread_local hash_code Token_Hash;
+
+enum Char_Class : unsigned char {
+  CHAR_OTHER = 0,
+  CHAR_SPACE = 1 << 0,
+  CHAR_ALPHA = 1 << 1,
+  CHAR_DIGIT = 1 << 2,
+};
 
-static int get_token() {
-  static int LastChar = ' ';
-  while (isspace(LastChar)) {
-    LastChar = fgetc(file);
-    if (LastChar == EOF) return EOF_TOKEN;
-  }
+static constexpr std::array<unsigned char, 256> make_char_classes() {
+  std::array<unsigned char, 256> Table{};
+  for (char C : {' ', '\t', '\n', '\v', '\f', '\r'})
+    Table[(unsigned char)C] = CHAR_SPACE;
+  for (int C = 'a'; C <= 'z'; ++C) Table[C] = CHAR_ALPHA;
+  for (int C = 'A'; C <= 'Z'; ++C) Table[C] = CHAR_ALPHA;
+  for (int C = '0'; C <= '9'; ++C) Table[C] = CHAR_DIGIT;
+  return Table;
+}
 
-  if (isalpha(LastChar)) {
-    Identifier_string = LastChar;
-    while (isalnum((LastChar = fgetc(file)))) Identifier_string += LastChar;
+static constexpr std::array<unsigned char, 256> Char_Classes =
+    make_char_classes();
 
-    if (Identifier_string == "def") return DEF_TOKEN;
-    if (Identifier_string == "if") return IF_TOKEN;
-    if (Identifier_string == "then") return THEN_TOKEN;
-    if (Identifier_string == "else") return ELSE_TOKEN;
-    if (Identifier_string == "for") return FOR_TOKEN;
-    if (Identifier_string == "in") return IN_TOKEN;
-    if (Identifier_string == "binary") return BINARY_TOKEN;
-    if (Identifier_string == "unary") return UNARY_TOKEN;
+static bool is_char_class(char C, unsigned char Class) {
+  return Char_Classes[(unsigned char)C] & Class;
+}
 
-    return IDENTIFIER_TOKEN;
-  }
+// Indexed by Toy_Keyword.
+static constexpr int Keyword_Tokens[KW_COUNT] = {
+    IDENTIFIER_TOKEN, DEF_TOKEN, IF_TOKEN,     THEN_TOKEN, ELSE_TOKEN,
+    FOR_TOKEN,        IN_TOKEN,  BINARY_TOKEN, UNARY_TOKEN, VAR_TOKEN,
+};
 
-  if (isdigit(LastChar)) {
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = fgetc(file);
-    } while (isdigit(LastChar));
+static int get_token() {
+  const char *P = Cur_Ptr;
+  const char *End = Source->getBufferEnd();
 
-    Numeric_Val = std::stoi(NumStr.c_str(), 0);
-    return NUMERIC_TOKEN;
+  while (true) {
+    while (is_char_class(*P, CHAR_SPACE)) ++P;
+    if (*P != '#') break;
+    while (P != End && *P != '\n' && *P != '\r') ++P;
   }
 
-  if (LastChar == '#') {
-    do LastChar = fgetc(file);
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+  const char *Start = P;
+  Token_Offset = Start - Source->getBufferStart();
 
-    if (LastChar != EOF) return get_token();
+  if (P == End) {
+    Cur_Ptr = P;
+    Token_Text = std::string_view();
+    return EOF_TOKEN;
   }
 
-  if (LastChar == EOF) return EOF_TOKEN;
+  int Token;
+  if (is_char_class(*P, CHAR_ALPHA)) {
+    do ++P;
+    while (is_char_class(*P, CHAR_ALPHA | CHAR_DIGIT));
+    Identifier_string = std::string_view(Start, P - Start);
+
+    Token = Keyword_Tokens[lookup_keyword(Identifier_string)];
+  } else if (is_char_class(*P, CHAR_DIGIT)) {
+    unsigned Value = 0;
+    do Value = Value * 10 + (*P++ - '0');
+    while (is_char_class(*P, CHAR_DIGIT));
+
+    Numeric_Val = (int)Value;
+    Token = NUMERIC_TOKEN;
+  } else {
+    Token = (unsigned char)*P++;
+  }
 
-  int ThisChar = LastChar;
-  LastChar = fgetc(file);
-  return ThisChar;
+  Token_Text = std::string_view(Start, P - Start);
+  Cur_Ptr = P;
+  return Token;
 }
 
 // =======================
 // AST Classes
 // =======================
+
+// Every node of the definition being parsed is bump-allocated from this
+// arena and the whole tree is released at once after Codegen(). Nodes are
+// never destroyed individually, so they must not own heap memory: names and
+// child lists point into the same arena.
+static thread_local BumpPtrAllocator *AST_Arena;
+
+static StringRef arena_string(StringRef S) { return S.copy(*AST_Arena); }
+
+template <typename T>
+static ArrayRef<T> arena_array(ArrayRef<T> Elements) {
+  return Elements.copy(*AST_Arena);
+}
+
+struct Tiered_Function;
+struct Interp_Scope;
+
+// Besides generating IR, every node can be interpreted. Resolve() binds
+// variables to frame slots and calls to their callees once, when the
+// definition is parsed; Evaluate() then runs the tree over a frame of i32
+// values with the same semantics as the generated code.
 class BaseAST {
  public:
+  BaseAST() { ++Num_AST_Nodes; }
   virtual ~BaseAST() = default;
   virtual Value *Codegen() = 0;
+  // Generates the node as the value the function returns, ending every path
+  // with a ret, so calls in tail position can become tail calls.
+  virtual bool CodegenReturn();
+  // Called on a function body: the node's value is the function's result.
+  virtual void markTailPosition() {}
+  virtual bool Resolve(Interp_Scope &S) = 0;
+  virtual int Evaluate(int *Frame) = 0;
+
+  // Returns the node to generate in place of this one, with constants
+  // folded and small operators inlined throughout its subtree.
+  virtual BaseAST *Simplify() = 0;
+  virtual bool getConstant(int &Val) const { return false; }
+  // Whether the node, as part of an operator body, can be copied into the
+  // operator's callers: every variable it uses must be in Scope, which
+  // starts out as the parameters. Each node uses up one unit of Budget.
+  virtual bool canInline(SmallVectorImpl<StringRef> &Scope,
+                         unsigned &Budget) const = 0;
+  // Copies a subtree canInline() accepted, renaming the variables found in
+  // Renames.
+  virtual BaseAST *Clone(const StringMap<StringRef> &Renames) const = 0;
+  // Adds the functions and user-defined operators the subtree calls, by the
+  // names of their definitions.
+  virtual void addCallees(StringSet<> &Callees) const = 0;
+
+ protected:
+  static bool takeNode(unsigned &Budget) { return Budget && Budget--; }
 };
 
 class NumericAST : public BaseAST {
@@ -106,33 +394,80 @@ class NumericAST : public BaseAST {
  public:
   NumericAST(int val) : numeric_val(val) {}
   Value *Codegen() override;
+  BaseAST *Simplify() override { return this; }
+  bool getConstant(int &Val) const override {
+    Val = numeric_val;
+    return true;
+  }
+  bool canInline(SmallVectorImpl<StringRef> &,
+                 unsigned &Budget) const override {
+    return takeNode(Budget);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &) const override;
+  void addCallees(StringSet<> &) const override {}
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
 };
 
 class VariableAST : public BaseAST {
-  std::string Var_Name;
+  StringRef Var_Name;
+  unsigned Slot = 0;
 
  public:
-  VariableAST(std::string &name) : Var_Name(name) {}
+  VariableAST(StringRef name) : Var_Name(name) {}
   Value *Codegen() override;
+  BaseAST *Simplify() override { return this; }
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    return takeNode(Budget) && is_contained(Scope, Var_Name);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &) const override {}
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
 };
 
 class ExprUnaryAST : public BaseAST {
   char Opcode;
   BaseAST *Operand;
+  Tiered_Function *Callee = nullptr;
 
  public:
   ExprUnaryAST(char op, BaseAST *operand) : Opcode(op), Operand(operand) {}
   Value *Codegen() override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    return takeNode(Budget) && Operand->canInline(Scope, Budget);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    Callees.insert((Twine("unary") + Twine(Opcode)).str());
+    Operand->addCallees(Callees);
+  }
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
 };
 
 class BinaryAST : public BaseAST {
-  std::string Bin_Operator;
+  char Bin_Operator;
   BaseAST *LHS, *RHS;
+  Tiered_Function *Callee = nullptr;
 
  public:
-  BinaryAST(std::string op, BaseAST *lhs, BaseAST *rhs)
+  BinaryAST(char op, BaseAST *lhs, BaseAST *rhs)
       : Bin_Operator(op), LHS(lhs), RHS(rhs) {}
   Value *Codegen() override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    return takeNode(Budget) && LHS->canInline(Scope, Budget) &&
+           RHS->canInline(Scope, Budget);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override;
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
 };
 
 class ExprIfAST : public BaseAST {
@@ -142,50 +477,161 @@ class ExprIfAST : public BaseAST {
   ExprIfAST(BaseAST *cond, BaseAST *then, BaseAST *else_st)
       : Cond(cond), Then(then), Else(else_st) {}
   Value *Codegen() override;
+  bool CodegenReturn() override;
+  void markTailPosition() override {
+    Then->markTailPosition();
+    Else->markTailPosition();
+  }
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    return takeNode(Budget) && Cond->canInline(Scope, Budget) &&
+           Then->canInline(Scope, Budget) && Else->canInline(Scope, Budget);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    Cond->addCallees(Callees);
+    Then->addCallees(Callees);
+    Else->addCallees(Callees);
+  }
 };
 
 class ExprForAST : public BaseAST {
-  std::string Var_Name;
+  StringRef Var_Name;
   BaseAST *Start, *End, *Step, *Body;
+  unsigned Slot = 0;
+  Tiered_Function *Owner = nullptr;
 
  public:
-  ExprForAST(const std::string &varname, BaseAST *start, BaseAST *end,
+  ExprForAST(StringRef varname, BaseAST *start, BaseAST *end,
              BaseAST *step, BaseAST *body)
       : Var_Name(varname), Start(start), End(end), Step(step), Body(body) {}
   Value *Codegen() override;
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override;
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    Start->addCallees(Callees);
+    End->addCallees(Callees);
+    if (Step) Step->addCallees(Callees);
+    Body->addCallees(Callees);
+  }
+};
+
+class AssignAST : public BaseAST {
+  StringRef Var_Name;
+  BaseAST *Value_Expr;
+  unsigned Slot = 0;
+
+ public:
+  AssignAST(StringRef name, BaseAST *value)
+      : Var_Name(name), Value_Expr(value) {}
+  Value *Codegen() override;
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    return takeNode(Budget) && Value_Expr->canInline(Scope, Budget) &&
+           is_contained(Scope, Var_Name);
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    Value_Expr->addCallees(Callees);
+  }
+};
+
+class VarAST : public BaseAST {
+  ArrayRef<StringRef> Var_Names;
+  ArrayRef<BaseAST *> Inits;  // null where a variable starts at 0
+  BaseAST *Body;
+  unsigned First_Slot = 0;
+
+  bool bindVariables(SmallVectorImpl<AllocaInst *> &Old_Bindings);
+  void restoreVariables(ArrayRef<AllocaInst *> Old_Bindings);
+
+ public:
+  VarAST(ArrayRef<StringRef> names, ArrayRef<BaseAST *> inits, BaseAST *body)
+      : Var_Names(names), Inits(inits), Body(body) {}
+  Value *Codegen() override;
+  bool CodegenReturn() override;
+  void markTailPosition() override { Body->markTailPosition(); }
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override;
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    for (BaseAST *Init : Inits)
+      if (Init) Init->addCallees(Callees);
+    Body->addCallees(Callees);
+  }
 };
 
 class FunctionCallAST : public BaseAST {
-  std::string Function_Callee;
-  std::vector<BaseAST *> Function_Arguments;
+  StringRef Function_Callee;
+  ArrayRef<BaseAST *> Function_Arguments;
+  Tiered_Function *Callee = nullptr;
+  bool Is_Tail = false;
+  bool Is_Self_Tail = false;
+
+  CallInst *CodegenCall();
 
  public:
-  FunctionCallAST(const std::string &callee, std::vector<BaseAST *> &args)
+  FunctionCallAST(StringRef callee, ArrayRef<BaseAST *> args)
       : Function_Callee(callee), Function_Arguments(args) {}
   Value *Codegen() override;
+  bool CodegenReturn() override;
+  void markTailPosition() override { Is_Tail = true; }
+  bool Resolve(Interp_Scope &S) override;
+  int Evaluate(int *Frame) override;
+  BaseAST *Simplify() override;
+  bool canInline(SmallVectorImpl<StringRef> &Scope,
+                 unsigned &Budget) const override {
+    if (!takeNode(Budget)) return false;
+    for (BaseAST *Arg : Function_Arguments)
+      if (!Arg->canInline(Scope, Budget)) return false;
+    return true;
+  }
+  BaseAST *Clone(const StringMap<StringRef> &Renames) const override;
+  void addCallees(StringSet<> &Callees) const override {
+    Callees.insert(Function_Callee);
+    for (BaseAST *Arg : Function_Arguments) Arg->addCallees(Callees);
+  }
 };
 
 class FunctionDeclAST {
-  std::string Func_Name;
-  std::vector<std::string> Arguments;
+  StringRef Func_Name;
+  ArrayRef<StringRef> Arguments;
   bool isOperator;
   unsigned Precedence;
 
  public:
-  FunctionDeclAST(const std::string &name, const std::vector<std::string> &args,
+  FunctionDeclAST(StringRef name, ArrayRef<StringRef> args,
                   bool isOperator = false, unsigned prec = 0)
       : Func_Name(name),
         Arguments(args),
         isOperator(isOperator),
-        Precedence(prec) {}
+        Precedence(prec) {
+    ++Num_AST_Nodes;
+  }
 
   bool isUnaryOp() const { return isOperator && Arguments.size() == 1; }
   bool isBinaryOp() const { return isOperator && Arguments.size() == 2; }
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Func_Name[Func_Name.size() - 1];
+    return Func_Name.back();
   }
   unsigned getBinaryPrecedence() const { return Precedence; }
+  StringRef getName() const { return Func_Name; }
+  ArrayRef<StringRef> getArgs() const { return Arguments; }
+  unsigned getNumArgs() const { return Arguments.size(); }
 
   Function *Codegen();
 };
@@ -196,23 +642,172 @@ class FunctionDefnAST {
 
  public:
   FunctionDefnAST(FunctionDeclAST *proto, BaseAST *body)
-      : Func_Decl(proto), Body(body) {}
+      : Func_Decl(proto), Body(body) {
+    ++Num_AST_Nodes;
+    Body->markTailPosition();
+  }
+  FunctionDeclAST *getDecl() const { return Func_Decl; }
+  BaseAST *getBody() const { return Body; }
   Function *Codegen();
+  void Simplify();
+};
+
+// =======================
+// Session
+// =======================
+
+// A definition run by the interpreter. Its tree stays alive in Arena for as
+// long as the session runs. Once the function is hot it is added to the JIT
+// together with every function it may call, and Native points to its entry
+// wrapper from then on.
+struct Tiered_Function {
+  FunctionDefnAST *Defn = nullptr;
+  std::shared_ptr<BumpPtrAllocator> Arena;
+  unsigned Frame_Size = 0;
+  unsigned Counter = 0;
+  SmallVector<Tiered_Function *, 4> Callees;
+  bool In_JIT = false;
+  // Set if tier_up failed; the function then stays interpreted.
+  bool Tier_Up_Failed = false;
+  int (*Native)(const int *Args) = nullptr;
+};
+
+// Operators small enough to inline, with the arena their tree lives in.
+struct Inline_Operator {
+  FunctionDefnAST *Defn;
+  std::shared_ptr<BumpPtrAllocator> Arena;
+};
+
+// A definition of an incremental session as it was last compiled.
+struct Definition_Record {
+  hash_code Token_Hash;
+  StringSet<> Callees;
+  // The tree as parsed, before simplifying, kept to compile it again when
+  // a function it calls changes.
+  FunctionDefnAST *Defn = nullptr;
+  std::shared_ptr<BumpPtrAllocator> Arena;
+  // Owns the definition's module in the JIT.
+  orc::ResourceTrackerSP Tracker;
+  // The program that last defined it.
+  unsigned Generation = 0;
+};
+
+// Everything a program's definitions leave behind for later ones. Sessions
+// share nothing but the command line options and the statistics, so
+// several of them can compile and run programs on different threads at
+// once. Each thread works for the session in Session; code generation
+// workers set it for the task they run.
+struct Toy_Session {
+  std::unique_ptr<orc::LLLazyJIT> JIT;
+  std::map<char, int> Operator_Precedence;
+
+  // Arity of every function defined so far, so that later modules can
+  // declare functions whose bodies live in modules already added to the
+  // JIT. Entries are added by the parser, before the definition is
+  // generated.
+  StringMap<unsigned> Function_Protos;
+  std::mutex Protos_Mutex;
+
+  StringMap<Tiered_Function> Tiered_Functions;
+  StringMap<Inline_Operator> Inline_Operators;
+
+  // Definitions are generated here when -j is greater than 1. Parsing stays
+  // on the compiling thread because user-defined operators change how the
+  // rest of the program parses.
+  std::unique_ptr<DefaultThreadPool> Codegen_Pool;
+
+  // Set when the session compiles new versions of a program, as -watch and
+  // Toy_Compiler do. A definition whose tokens did not change keeps its
+  // code. A changed one replaces it, and so do the definitions that call it
+  // directly or not, in any program, since their code was linked and
+  // perhaps inlined against the old version.
+  bool Incremental = false;
+  // Set under -watch, where every program is the whole file again, so the
+  // definitions it no longer has are removed.
+  bool Whole_Program = false;
+  StringMap<Definition_Record> Definitions;
+  // The definitions that call each name.
+  StringMap<StringSet<>> Callers;
+  unsigned Generation = 0;
+  // Definitions of the current program that had to be compiled.
+  StringSet<> Recompiled;
+
+  bool Print_IR = false;
+  bool Print_Results = false;
+  // Values of the top-level expressions evaluated so far.
+  std::vector<int> Results;
+
+  // What went wrong in the current program, from any codegen thread:
+  // definitions and expressions that did not compile, and errors of the
+  // JIT. Toy_Compiler::run fails on both; the command line only on the
+  // latter, as the toy has always skipped bad definitions. A failed
+  // definition keeps the tracker its code would have gone to.
+  std::mutex Errors_Mutex;
+  std::vector<std::pair<std::string, orc::ResourceTrackerSP>> Failures;
+  std::vector<Error> Errors;
+};
+
+static thread_local Toy_Session *Session;
+
+// Makes S the session of the current thread until the scope ends.
+class Session_Scope {
+  Toy_Session *Saved;
+
+ public:
+  explicit Session_Scope(Toy_Session &S) : Saved(Session) { Session = &S; }
+  ~Session_Scope() { Session = Saved; }
 };
 
+static void record_failure(const Twine &What,
+                           orc::ResourceTrackerSP Tracker = nullptr) {
+  std::lock_guard<std::mutex> Lock(Session->Errors_Mutex);
+  Session->Failures.emplace_back(What.str(), std::move(Tracker));
+}
+
+static void record_error(Error Err) {
+  if (!Err) return;
+  std::lock_guard<std::mutex> Lock(Session->Errors_Mutex);
+  Session->Errors.push_back(std::move(Err));
+}
+
+// Returns the errors of the current program, and its failures too if
+// With_Failures is set, and forgets both. A definition whose tracker was
+// removed since it failed has been replaced, like a caller compiled again
+// from its old tree before the program redefined it, so it is no failure.
+static Error take_errors(bool With_Failures) {
+  std::lock_guard<std::mutex> Lock(Session->Errors_Mutex);
+  Error Result = Error::success();
+  if (With_Failures)
+    for (const auto &[What, Tracker] : Session->Failures)
+      if (!Tracker || !Tracker->isDefunct())
+          Result = joinErrors(
+            std::move(Result),
+            make_error<StringError>(What, inconvertibleErrorCode()));
+  for (Error &Err : Session->Errors)
+    Result = joinErrors(std::move(Result), std::move(Err));
+  Session->Failures.clear();
+  Session->Errors.clear();
+  return Result;
+}
+
 // =======================
 // Parser
 // =======================
 
-static int Current_token;
-static std::map<char, int> Operator_Precedence;
+static thread_local int Current_token;
 
-static int next_token() { return Current_token = get_token(); }
+static int next_token() {
+  Phase_Timer Timer(PHASE_LEX);
+  ++Num_Tokens;
+  if (Session->Incremental)
+    Token_Hash = hash_combine(Token_Hash, StringRef(Token_Text));
+  return Current_token = get_token();
+}
 
 static int getBinOpPrecedence() {
   if (!isascii(Current_token)) return -1;
 
-  int TokPrec = Operator_Precedence[Current_token];
+  int TokPrec = Session->Operator_Precedence[Current_token];
   if (TokPrec <= 0) return -1;
   return TokPrec;
 }
@@ -220,19 +815,28 @@ static int getBinOpPrecedence() {
 static BaseAST *expression_parser();
 
 static BaseAST *numeric_parser() {
-  BaseAST *Result = new NumericAST(Numeric_Val);
+  BaseAST *Result = new (*AST_Arena) NumericAST(Numeric_Val);
   next_token();
   return Result;
 }
 
 static BaseAST *identifier_parser() {
-  std::string IdName = Identifier_string;
+  StringRef IdName = arena_string(Identifier_string);
   next_token();  // eat identifier
 
-  if (Current_token != '(') return new VariableAST(IdName);
+  // '=' is not a binary operator: an assignment takes the whole expression
+  // to its right, so it binds looser than any operator.
+  if (Current_token == '=') {
+    next_token();  // eat '='
+    BaseAST *Value = expression_parser();
+    if (!Value) return nullptr;
+    return new (*AST_Arena) AssignAST(IdName, Value);
+  }
+
+  if (Current_token != '(') return new (*AST_Arena) VariableAST(IdName);
 
   next_token();  // eat '('
-  std::vector<BaseAST *> Args;
+  SmallVector<BaseAST *, 8> Args;
 
   if (Current_token != ')') {
     while (true) {
@@ -249,7 +853,8 @@ static BaseAST *identifier_parser() {
   }
 
   next_token();  // eat ')'
-  return new FunctionCallAST(IdName, Args);
+  return new (*AST_Arena)
+      FunctionCallAST(IdName, arena_array<BaseAST *>(Args));
 }
 
 static BaseAST *paran_parser() {
@@ -281,7 +886,7 @@ static BaseAST *if_parser() {
   BaseAST *Else = expression_parser();
   if (!Else) return nullptr;
 
-  return new ExprIfAST(Cond, Then, Else);
+  return new (*AST_Arena) ExprIfAST(Cond, Then, Else);
 }
 
 static BaseAST *for_parser() {
@@ -289,7 +894,7 @@ static BaseAST *for_parser() {
 
   if (Current_token != IDENTIFIER_TOKEN) return nullptr;
 
-  std::string IdName = Identifier_string;
+  StringRef IdName = arena_string(Identifier_string);
   next_token();  // eat identifier
 
   if (Current_token != '=') return nullptr;
@@ -316,7 +921,39 @@ static BaseAST *for_parser() {
   BaseAST *Body = expression_parser();
   if (!Body) return nullptr;
 
-  return new ExprForAST(IdName, Start, End, Step, Body);
+  return new (*AST_Arena) ExprForAST(IdName, Start, End, Step, Body);
+}
+
+static BaseAST *var_parser() {
+  next_token();  // eat 'var'
+
+  SmallVector<StringRef, 4> Names;
+  SmallVector<BaseAST *, 4> Inits;
+  while (true) {
+    if (Current_token != IDENTIFIER_TOKEN) return nullptr;
+    Names.push_back(arena_string(Identifier_string));
+    next_token();  // eat identifier
+
+    BaseAST *Init = nullptr;
+    if (Current_token == '=') {
+      next_token();  // eat '='
+      Init = expression_parser();
+      if (!Init) return nullptr;
+    }
+    Inits.push_back(Init);
+
+    if (Current_token != ',') break;
+    next_token();  // eat ','
+  }
+
+  if (Current_token != IN_TOKEN) return nullptr;
+  next_token();  // eat 'in'
+
+  BaseAST *Body = expression_parser();
+  if (!Body) return nullptr;
+
+  return new (*AST_Arena) VarAST(arena_array<StringRef>(Names),
+                                 arena_array<BaseAST *>(Inits), Body);
 }
 
 static BaseAST *base_parser() {
@@ -331,23 +968,28 @@ static BaseAST *base_parser() {
       return if_parser();
     case FOR_TOKEN:
       return for_parser();
+    case VAR_TOKEN:
+      return var_parser();
     default:
       return nullptr;
   }
 }
 
 static BaseAST *unary_parser() {
-  if (!isascii(Current_token) || Current_token == '(' || Current_token == ',')
+  if (!isascii(Current_token) || Current_token == '(' ||
+      Current_token == ',' || Current_token == EOF_TOKEN)
     return base_parser();
 
   if (Current_token == IF_TOKEN || Current_token == FOR_TOKEN ||
-      Current_token == IDENTIFIER_TOKEN || Current_token == NUMERIC_TOKEN)
+      Current_token == VAR_TOKEN || Current_token == IDENTIFIER_TOKEN ||
+      Current_token == NUMERIC_TOKEN)
     return base_parser();
 
   int Op = Current_token;
   next_token();  // eat unary operator
 
-  if (BaseAST *Operand = unary_parser()) return new ExprUnaryAST(Op, Operand);
+  if (BaseAST *Operand = unary_parser())
+    return new (*AST_Arena) ExprUnaryAST(Op, Operand);
   return nullptr;
 }
 
@@ -357,7 +999,7 @@ static BaseAST *binary_op_parser(int Old_Prec, BaseAST *LHS) {
 
     if (Operator_Prec < Old_Prec) return LHS;
 
-    int BinOp = Current_token;
+    char BinOp = Current_token;
     next_token();  // eat binary operator
 
     BaseAST *RHS = unary_parser();
@@ -369,7 +1011,7 @@ static BaseAST *binary_op_parser(int Old_Prec, BaseAST *LHS) {
       if (!RHS) return nullptr;
     }
 
-    LHS = new BinaryAST(std::to_string(BinOp), LHS, RHS);
+    LHS = new (*AST_Arena) BinaryAST(BinOp, LHS, RHS);
   }
 }
 
@@ -381,7 +1023,7 @@ static BaseAST *expression_parser() {
 }
 
 static FunctionDeclAST *func_decl_parser() {
-  std::string Function_Name;
+  SmallString<16> Function_Name;
   unsigned Kind = 0;
   unsigned BinaryPrecedence = 30;
 
@@ -418,17 +1060,19 @@ static FunctionDeclAST *func_decl_parser() {
 
   if (Current_token != '(') return nullptr;
 
-  std::vector<std::string> Function_Argument_Names;
+  SmallVector<StringRef, 8> Function_Argument_Names;
   while (next_token() == IDENTIFIER_TOKEN)
-    Function_Argument_Names.push_back(Identifier_string);
+    Function_Argument_Names.push_back(arena_string(Identifier_string));
 
   if (Current_token != ')') return nullptr;
   next_token();  // eat ')'
 
   if (Kind && Function_Argument_Names.size() != Kind) return nullptr;
 
-  return new FunctionDeclAST(Function_Name, Function_Argument_Names, Kind != 0,
-                             BinaryPrecedence);
+  return new (*AST_Arena) FunctionDeclAST(
+      arena_string(Function_Name),
+      arena_array<StringRef>(Function_Argument_Names), Kind != 0,
+      BinaryPrecedence);
 }
 
 static FunctionDefnAST *func_defn_parser() {
@@ -438,251 +1082,1887 @@ static FunctionDefnAST *func_defn_parser() {
   if (!Decl) return nullptr;
 
   if (BaseAST *Body = expression_parser())
-    return new FunctionDefnAST(Decl, Body);
+    return new (*AST_Arena) FunctionDefnAST(Decl, Body);
   return nullptr;
 }
 
 static FunctionDefnAST *top_level_parser() {
   if (BaseAST *E = expression_parser()) {
-    FunctionDeclAST *Decl = new FunctionDeclAST("", std::vector<std::string>());
-    return new FunctionDefnAST(Decl, E);
+    FunctionDeclAST *Decl =
+        new (*AST_Arena) FunctionDeclAST("__anon_expr", {});
+    return new (*AST_Arena) FunctionDefnAST(Decl, E);
   }
   return nullptr;
 }
 
 // =======================
-// Code Generation
+// AST Optimization
 // =======================
 
-static Module *TheModule;
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::map<std::string, Value *> Named_Values;
+// Runs on every definition at -O1 and above, between parsing and Codegen().
+// The rewrites keep the semantics of the generated code exactly: i32
+// arithmetic wraps, '<' is unsigned, and no expression that may assign a
+// variable or call a function is dropped, except from the branch of an if
+// that can never run.
+
+static cl::opt<unsigned> InlineOperatorSize(
+    "inline-operator-size", cl::init(16),
+    cl::desc("Largest user operator, in AST nodes, that is inlined into its "
+             "uses before code generation (0 disables)"));
+
+// Only an operator simplified before it was registered is inlined, so
+// operators never inline into themselves.
+static void register_inline_operator(FunctionDefnAST *F,
+                                     std::shared_ptr<BumpPtrAllocator> Arena) {
+  FunctionDeclAST *Decl = F->getDecl();
+  SmallVector<StringRef, 8> Scope(Decl->getArgs().begin(),
+                                  Decl->getArgs().end());
+  unsigned Budget = InlineOperatorSize;
+  if (F->getBody()->canInline(Scope, Budget))
+    Session->Inline_Operators[Decl->getName()] = {F, std::move(Arena)};
+}
 
-Value *NumericAST::Codegen() {
-  return ConstantInt::get(Type::getInt32Ty(TheContext), numeric_val);
+// Becomes "var a.N = <lhs>, b.N = <rhs> in <body>". The arguments are still
+// evaluated once each, in order, before the body, and the new names contain
+// a '.', so they cannot capture a variable of an argument. Variables the
+// body declares itself keep their names: they only shadow the caller's
+// inside the body, which never uses those.
+static BaseAST *inline_operator(StringRef Name, ArrayRef<BaseAST *> Args) {
+  auto It = Session->Inline_Operators.find(Name);
+  if (It == Session->Inline_Operators.end()) return nullptr;
+
+  unsigned Id = ++Num_Operators_Inlined;
+  StringMap<StringRef> Renames;
+  SmallVector<StringRef, 2> Names;
+  for (StringRef Param : It->second.Defn->getDecl()->getArgs()) {
+    Names.push_back(arena_string((Param + "." + Twine(Id)).str()));
+    Renames[Param] = Names.back();
+  }
+
+  return new (*AST_Arena)
+      VarAST(arena_array<StringRef>(Names), arena_array<BaseAST *>(Args),
+             It->second.Defn->getBody()->Clone(Renames));
 }
 
-Value *VariableAST::Codegen() {
-  Value *V = Named_Values[Var_Name];
-  return V ? V : nullptr;
+// Folds like BinaryAST::Codegen computes, and leaves the divisions that are
+// undefined for sdiv to run as written.
+static bool fold_binary(char Op, int L, int R, int &Result) {
+  switch (Op) {
+    case '+':
+      Result = (int)((unsigned)L + (unsigned)R);
+      return true;
+    case '-':
+      Result = (int)((unsigned)L - (unsigned)R);
+      return true;
+    case '*':
+      Result = (int)((unsigned)L * (unsigned)R);
+      return true;
+    case '/':
+      if (R == 0 || (L == INT_MIN && R == -1)) return false;
+      Result = L / R;
+      return true;
+    case '<':
+      Result = (unsigned)L < (unsigned)R;
+      return true;
+    default:
+      return false;
+  }
 }
 
-Value *ExprUnaryAST::Codegen() {
-  Value *OperandV = Operand->Codegen();
-  if (!OperandV) return nullptr;
+// x + 0, x - 0, x * 1 and x / 1 are x, and so are 0 + x and 1 * x.
+static bool is_identity(char Op, int Val, bool Is_RHS) {
+  switch (Op) {
+    case '+':
+      return Val == 0;
+    case '-':
+      return Is_RHS && Val == 0;
+    case '*':
+      return Val == 1;
+    case '/':
+      return Is_RHS && Val == 1;
+    default:
+      return false;
+  }
+}
 
-  Function *F = TheModule->getFunction(std::string("unary") + Opcode);
-  if (!F) return nullptr;
+BaseAST *ExprUnaryAST::Simplify() {
+  Operand = Operand->Simplify();
 
-  return Builder.CreateCall(F, OperandV, "unop");
+  if (BaseAST *Inlined =
+          inline_operator((Twine("unary") + Twine(Opcode)).str(), Operand))
+    return Inlined;
+  return this;
 }
 
-Value *BinaryAST::Codegen() {
-  Value *L = LHS->Codegen();
-  Value *R = RHS->Codegen();
+BaseAST *BinaryAST::Simplify() {
+  LHS = LHS->Simplify();
+  RHS = RHS->Simplify();
+
+  int L, R, Result;
+  bool Constant_L = LHS->getConstant(L);
+  bool Constant_R = RHS->getConstant(R);
+  if (Constant_L && Constant_R && fold_binary(Bin_Operator, L, R, Result)) {
+    ++Num_Constants_Folded;
+    return new (*AST_Arena) NumericAST(Result);
+  }
+  if (Constant_R && is_identity(Bin_Operator, R, true)) return LHS;
+  if (Constant_L && is_identity(Bin_Operator, L, false)) return RHS;
 
-  switch (std::stoi(Bin_Operator)) {
+  switch (Bin_Operator) {
     case '+':
-      return Builder.CreateAdd(L, R, "addtmp");
     case '-':
-      return Builder.CreateSub(L, R, "subtmp");
     case '*':
-      return Builder.CreateMul(L, R, "multmp");
     case '/':
-      return Builder.CreateSDiv(L, R, "divtmp");
     case '<':
-      L = Builder.CreateICmpULT(L, R, "cmptmp");
-      return Builder.CreateZExt(L, Type::getInt32Ty(TheContext), "booltmp");
+      return this;
     default:
       break;
   }
 
-  Function *F = TheModule->getFunction(std::string("binary") + Bin_Operator);
-  Value *Ops[2] = {L, R};
+  BaseAST *Args[2] = {LHS, RHS};
+  if (BaseAST *Inlined = inline_operator(
+          (Twine("binary") + Twine(Bin_Operator)).str(), Args))
+    return Inlined;
+  return this;
+}
 
-  return Builder.CreateCall(F, Ops, "binop");
+BaseAST *ExprIfAST::Simplify() {
+  Cond = Cond->Simplify();
+  Then = Then->Simplify();
+  Else = Else->Simplify();
+
+  int Val;
+  if (!Cond->getConstant(Val)) return this;
+  ++Num_Constants_Folded;
+  return Val ? Then : Else;
 }
 
-Value *ExprIfAST::Codegen() {
-  Value *Condtn = Cond->Codegen();
-  if (!Condtn) return nullptr;
+BaseAST *ExprForAST::Simplify() {
+  Start = Start->Simplify();
+  End = End->Simplify();
+  if (Step) Step = Step->Simplify();
+  Body = Body->Simplify();
+  return this;
+}
 
-  Condtn = Builder.CreateICmpNE(
-      Condtn, ConstantInt::get(Type::getInt32Ty(TheContext), 0), "ifcond");
+BaseAST *AssignAST::Simplify() {
+  Value_Expr = Value_Expr->Simplify();
+  return this;
+}
 
-  Function *TheFunc = Builder.GetInsertBlock()->getParent();
+BaseAST *VarAST::Simplify() {
+  SmallVector<BaseAST *, 4> New_Inits;
+  for (BaseAST *Init : Inits)
+    New_Inits.push_back(Init ? Init->Simplify() : nullptr);
+  Inits = arena_array<BaseAST *>(New_Inits);
+  Body = Body->Simplify();
+  return this;
+}
 
-  BasicBlock *ThenBB = BasicBlock::Create(TheContext, "then", TheFunc);
-  BasicBlock *ElseBB = BasicBlock::Create(TheContext, "else");
-  BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
+BaseAST *FunctionCallAST::Simplify() {
+  SmallVector<BaseAST *, 8> Args;
+  for (BaseAST *Arg : Function_Arguments) Args.push_back(Arg->Simplify());
+  Function_Arguments = arena_array<BaseAST *>(Args);
+  return this;
+}
 
-  Builder.CreateCondBr(Condtn, ThenBB, ElseBB);
-  Builder.SetInsertPoint(ThenBB);
+// Simplifying can move a call into tail position, for example out of
+// "f(x) + 0", so the body is marked again.
+void FunctionDefnAST::Simplify() {
+  Body = Body->Simplify();
+  Body->markTailPosition();
+}
 
-  Value *ThenVal = Then->Codegen();
-  if (!ThenVal) return nullptr;
+BaseAST *NumericAST::Clone(const StringMap<StringRef> &) const {
+  return new (*AST_Arena) NumericAST(numeric_val);
+}
 
-  Builder.CreateBr(MergeBB);
-  ThenBB = Builder.GetInsertBlock();
+static StringRef rename(const StringMap<StringRef> &Renames, StringRef Name) {
+  auto It = Renames.find(Name);
+  return It == Renames.end() ? Name : It->second;
+}
 
-  TheFunc->insert(TheFunc->end(), ElseBB);
-  Builder.SetInsertPoint(ElseBB);
+BaseAST *VariableAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena) VariableAST(rename(Renames, Var_Name));
+}
 
-  Value *ElseVal = Else->Codegen();
-  if (!ElseVal) return nullptr;
+BaseAST *ExprUnaryAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena) ExprUnaryAST(Opcode, Operand->Clone(Renames));
+}
 
-  Builder.CreateBr(MergeBB);
-  ElseBB = Builder.GetInsertBlock();
+BaseAST *BinaryAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena)
+      BinaryAST(Bin_Operator, LHS->Clone(Renames), RHS->Clone(Renames));
+}
 
-  TheFunc->insert(TheFunc->end(), MergeBB);
-  Builder.SetInsertPoint(MergeBB);
+void BinaryAST::addCallees(StringSet<> &Callees) const {
+  switch (Bin_Operator) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '<':
+      break;
+    default:
+      Callees.insert((Twine("binary") + Twine(Bin_Operator)).str());
+      break;
+  }
+  LHS->addCallees(Callees);
+  RHS->addCallees(Callees);
+}
 
-  PHINode *PN = Builder.CreatePHI(Type::getInt32Ty(TheContext), 2, "iftmp");
-  PN->addIncoming(ThenVal, ThenBB);
-  PN->addIncoming(ElseVal, ElseBB);
+BaseAST *ExprIfAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena) ExprIfAST(Cond->Clone(Renames),
+                                    Then->Clone(Renames), Else->Clone(Renames));
+}
 
-  return PN;
+// The loop variable is in scope for the body, step and end condition, like
+// ExprForAST::Codegen binds it.
+bool ExprForAST::canInline(SmallVectorImpl<StringRef> &Scope,
+                           unsigned &Budget) const {
+  if (!takeNode(Budget) || !Start->canInline(Scope, Budget)) return false;
+
+  Scope.push_back(Var_Name);
+  bool Inlinable = Body->canInline(Scope, Budget) &&
+                   (!Step || Step->canInline(Scope, Budget)) &&
+                   End->canInline(Scope, Budget);
+  Scope.pop_back();
+  return Inlinable;
 }
 
-Value *ExprForAST::Codegen() {
-  Value *StartVal = Start->Codegen();
-  if (!StartVal) return nullptr;
+BaseAST *ExprForAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena) ExprForAST(
+      rename(Renames, Var_Name), Start->Clone(Renames), End->Clone(Renames),
+      Step ? Step->Clone(Renames) : nullptr, Body->Clone(Renames));
+}
 
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+BaseAST *AssignAST::Clone(const StringMap<StringRef> &Renames) const {
+  return new (*AST_Arena)
+      AssignAST(rename(Renames, Var_Name), Value_Expr->Clone(Renames));
+}
 
-  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
-  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+bool VarAST::canInline(SmallVectorImpl<StringRef> &Scope,
+                       unsigned &Budget) const {
+  if (!takeNode(Budget)) return false;
 
-  Builder.CreateBr(LoopBB);
-  Builder.SetInsertPoint(LoopBB);
+  size_t Outer_Size = Scope.size();
+  bool Inlinable = true;
+  for (unsigned I = 0, E = Var_Names.size(); I != E && Inlinable; ++I) {
+    Inlinable = !Inits[I] || Inits[I]->canInline(Scope, Budget);
+    Scope.push_back(Var_Names[I]);
+  }
+  Inlinable = Inlinable && Body->canInline(Scope, Budget);
+  Scope.truncate(Outer_Size);
+  return Inlinable;
+}
 
-  PHINode *Var =
-      Builder.CreatePHI(Type::getInt32Ty(TheContext), 2, Var_Name.c_str());
+BaseAST *VarAST::Clone(const StringMap<StringRef> &Renames) const {
+  SmallVector<StringRef, 4> Names;
+  SmallVector<BaseAST *, 4> New_Inits;
+  for (unsigned I = 0, E = Var_Names.size(); I != E; ++I) {
+    Names.push_back(rename(Renames, Var_Names[I]));
+    New_Inits.push_back(Inits[I] ? Inits[I]->Clone(Renames) : nullptr);
+  }
+  return new (*AST_Arena)
+      VarAST(arena_array<StringRef>(Names), arena_array<BaseAST *>(New_Inits),
+             Body->Clone(Renames));
+}
 
-  Var->addIncoming(StartVal, PreheaderBB);
+BaseAST *FunctionCallAST::Clone(const StringMap<StringRef> &Renames) const {
+  SmallVector<BaseAST *, 8> Args;
+  for (BaseAST *Arg : Function_Arguments) Args.push_back(Arg->Clone(Renames));
+  return new (*AST_Arena)
+      FunctionCallAST(Function_Callee, arena_array<BaseAST *>(Args));
+}
 
-  Value *OldVal = Named_Values[Var_Name];
-  Named_Values[Var_Name] = Var;
+// =======================
+// Code Generation
+// =======================
 
-  if (!Body->Codegen()) return nullptr;
+// Each definition is generated into its own module, which is handed to the
+// JIT together with its context once the definition is complete. The state
+// is per thread, so every code generation worker has its own LLVMContext.
+static thread_local std::unique_ptr<LLVMContext> TheContext;
+static thread_local std::unique_ptr<Module> TheModule;
+static thread_local std::unique_ptr<IRBuilder<>> Builder;
+static thread_local StringMap<AllocaInst *> Named_Values;
+static ExitOnError ExitOnErr;
+
+// User-defined operator functions of TheModule, indexed by the operator
+// character, so operator nodes never look them up by name.
+static thread_local Function *Unary_Operators[128];
+static thread_local Function *Binary_Operators[128];
+
+static cl::opt<unsigned> OptLevel(
+    "O", cl::Prefix, cl::init(0),
+    cl::desc("Optimization level applied to every function: -O0 to -O3"));
+
+static cl::list<std::string> PassPlugins(
+    "load-pass-plugin", cl::value_desc("plugin"),
+    cl::desc("Load passes from a plugin library, for -plugin-passes"));
+
+static cl::opt<std::string> PluginPasses(
+    "plugin-passes", cl::value_desc("pipeline"),
+    cl::desc("Module pipeline run on every module after it is optimized, "
+             "e.g. block-counter"));
+
+// Loaded once, by main, and registered with every pass builder.
+static std::vector<PassPlugin> Pass_Plugins;
+
+// Unlike the module state, the pass pipeline is built once per thread; only
+// its cached analyses are dropped between modules.
+static thread_local std::unique_ptr<TargetMachine> Opt_TM;
+static thread_local std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+static thread_local std::unique_ptr<FunctionPassManager> TheFPM;
+static thread_local std::unique_ptr<ModulePassManager> ThePluginMPM;
+static thread_local std::unique_ptr<LoopAnalysisManager> TheLAM;
+static thread_local std::unique_ptr<FunctionAnalysisManager> TheFAM;
+static thread_local std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+static thread_local std::unique_ptr<ModuleAnalysisManager> TheMAM;
+
+// Inclusive wall time of every pass on every thread, reported by -time-passes.
+static StringMap<double> Pass_Seconds;
+static double Pipeline_Seconds;
+static std::mutex Pass_Seconds_Mutex;
+static thread_local SmallVector<std::chrono::steady_clock::time_point, 8>
+    Pass_Start_Times;
+
+static void record_pass_time(StringRef Pass) {
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Pass_Start_Times.pop_back_val();
+
+  std::lock_guard<std::mutex> Lock(Pass_Seconds_Mutex);
+  Pass_Seconds[Pass] += Elapsed.count();
+}
 
-  Value *StepVal;
-  if (Step) {
-    StepVal = Step->Codegen();
-    if (!StepVal) return nullptr;
-  } else {
-    StepVal = ConstantInt::get(Type::getInt32Ty(TheContext), 1);
-  }
+static void register_pass_timers(PassInstrumentationCallbacks &PIC) {
+  PIC.registerBeforeNonSkippedPassCallback([](StringRef, Any) {
+    Pass_Start_Times.push_back(std::chrono::steady_clock::now());
+  });
+  PIC.registerAfterPassCallback(
+      [](StringRef Pass, Any, const PreservedAnalyses &) {
+        record_pass_time(Pass);
+      });
+  PIC.registerAfterPassInvalidatedCallback(
+      [](StringRef Pass, const PreservedAnalyses &) {
+        record_pass_time(Pass);
+      });
+}
 
-  Value *NextVar = Builder.CreateAdd(Var, StepVal, "nextvar");
+static void add_optimization_passes(FunctionPassManager &FPM) {
+  FPM.addPass(PromotePass());
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(SimplifyCFGPass());
+  if (OptLevel < 2) return;
+
+  FPM.addPass(ReassociatePass());
+  FPM.addPass(GVNPass());
+
+  LICMOptions LICMOpts;
+  FPM.addPass(createFunctionToLoopPassAdaptor(LoopRotatePass()));
+  FPM.addPass(createFunctionToLoopPassAdaptor(LICMPass(LICMOpts),
+                                              /*UseMemorySSA=*/true));
+  FPM.addPass(createFunctionToLoopPassAdaptor(IndVarSimplifyPass()));
+  FPM.addPass(createFunctionToLoopPassAdaptor(LoopDeletionPass()));
+  if (OptLevel >= 3) FPM.addPass(LoopUnrollPass(LoopUnrollOptions(OptLevel)));
+
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(SimplifyCFGPass());
+}
 
-  Value *EndCond = End->Codegen();
-  if (!EndCond) return nullptr;
+static void InitializePassManagers() {
+  if (!Opt_TM) {
+    orc::JITTargetMachineBuilder JTMB =
+        ExitOnErr(orc::JITTargetMachineBuilder::detectHost());
+    Opt_TM = ExitOnErr(JTMB.createTargetMachine());
+  }
 
-  EndCond = Builder.CreateICmpNE(
-      EndCond, ConstantInt::get(Type::getInt32Ty(TheContext), 0), "loopcond");
+  // Cached results, like the proxies of the plugin passes, refer to the
+  // managers of the smaller IR units, so those are cleared last.
+  if (TheMAM) {
+    TheMAM->clear();
+    TheCGAM->clear();
+    TheFAM->clear();
+    TheLAM->clear();
+    return;
+  }
 
-  BasicBlock *LoopEndBB = Builder.GetInsertBlock();
-  BasicBlock *AfterBB =
-      BasicBlock::Create(TheContext, "afterloop", TheFunction);
+  ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+  TheFPM = std::make_unique<FunctionPassManager>();
+  TheLAM = std::make_unique<LoopAnalysisManager>();
+  TheFAM = std::make_unique<FunctionAnalysisManager>();
+  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+  TheMAM = std::make_unique<ModuleAnalysisManager>();
+  if (TimePassesIsEnabled) register_pass_timers(*ThePIC);
+
+  PassBuilder PB(Opt_TM.get(), PipelineTuningOptions(), std::nullopt,
+                 ThePIC.get());
+  PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
+  PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
+  PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+  if (OptLevel > 0) add_optimization_passes(*TheFPM);
+  if (!PluginPasses.empty()) {
+    for (PassPlugin &Plugin : Pass_Plugins)
+      Plugin.registerPassBuilderCallbacks(PB);
+    ThePluginMPM = std::make_unique<ModulePassManager>();
+    ExitOnErr(PB.parsePassPipeline(*ThePluginMPM, PluginPasses));
+  }
+}
 
-  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
-  Builder.SetInsertPoint(AfterBB);
-  Var->addIncoming(NextVar, LoopEndBB);
+static void run_function_passes(FunctionPassManager &FPM, Function &F) {
+  Phase_Timer Timer(PHASE_OPTIMIZE);
+  auto Start = std::chrono::steady_clock::now();
+  FPM.run(F, *TheFAM);
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
 
-  if (OldVal)
-    Named_Values[Var_Name] = OldVal;
-  else
-    Named_Values.erase(Var_Name);
+  std::lock_guard<std::mutex> Lock(Pass_Seconds_Mutex);
+  Pipeline_Seconds += Elapsed.count();
+}
+
+static void optimize_function(Function &F) {
+  if (TheFPM) run_function_passes(*TheFPM, F);
+}
 
-  return Constant::getNullValue(Type::getInt32Ty(TheContext));
+// Runs -plugin-passes on a module that is about to be compiled.
+static void run_plugin_passes(Module &M) {
+  if (!ThePluginMPM) return;
+  Phase_Timer Timer(PHASE_OPTIMIZE);
+  ThePluginMPM->run(M, *TheMAM);
 }
 
-Value *FunctionCallAST::Codegen() {
-  Function *CalleeF = TheModule->getFunction(Function_Callee);
+static void print_pass_times() {
+  std::vector<std::pair<StringRef, double>> Times;
+  for (const auto &Entry : Pass_Seconds)
+    Times.emplace_back(Entry.getKey(), Entry.getValue());
+  llvm::sort(Times, [](const auto &A, const auto &B) {
+    return A.second > B.second;
+  });
+
+  errs() << "===--- Toy optimization pass times (-O" << OptLevel
+         << ", inclusive) ---===\n";
+  errs() << format("  Total pipeline time: %.4f s\n\n", Pipeline_Seconds);
+  errs() << "    Seconds  Percent  Pass\n";
+  for (const auto &[Pass, Seconds] : Times)
+    errs() << format("  %9.4f  %6.2f%%  ", Seconds,
+                     Pipeline_Seconds ? 100 * Seconds / Pipeline_Seconds : 0.0)
+           << Pass << "\n";
+}
 
-  std::vector<Value *> ArgsV;
-  for (unsigned i = 0, e = Function_Arguments.size(); i != e; ++i) {
-    ArgsV.push_back(Function_Arguments[i]->Codegen());
-    if (!ArgsV.back()) return nullptr;
+static void InitializeModule() {
+  // Analyses cached for the last module go before it does.
+  if (OptLevel > 0 || !PluginPasses.empty()) InitializePassManagers();
+
+  // A module left over from an earlier program goes before its context.
+  Builder.reset();
+  TheModule.reset();
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>("toy jit", *TheContext);
+  if (Session->JIT) {
+    TheModule->setDataLayout(Session->JIT->getDataLayout());
+  } else {
+    TheModule->setDataLayout(Opt_TM->createDataLayout());
+    TheModule->setTargetTriple(Opt_TM->getTargetTriple().str());
   }
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  std::fill(std::begin(Unary_Operators), std::end(Unary_Operators), nullptr);
+  std::fill(std::begin(Binary_Operators), std::end(Binary_Operators), nullptr);
 }
 
-Function *FunctionDeclAST::Codegen() {
-  std::vector<Type *> Integers(Arguments.size(), Type::getInt32Ty(TheContext));
-  FunctionType *FT =
-      FunctionType::get(Type::getInt32Ty(TheContext), Integers, false);
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Func_Name, TheModule);
+static bool declare_function(StringRef Name, unsigned NumArgs) {
+  std::lock_guard<std::mutex> Lock(Session->Protos_Mutex);
+  return Session->Function_Protos.try_emplace(Name, NumArgs).second;
+}
 
-  if (F->getName() != Func_Name) {
-    F->eraseFromParent();
-    F = TheModule->getFunction(Func_Name);
+static void forget_function(StringRef Name) {
+  std::lock_guard<std::mutex> Lock(Session->Protos_Mutex);
+  Session->Function_Protos.erase(Name);
+}
 
-    if (!F->empty()) return nullptr;
-    if (F->arg_size() != Arguments.size()) return nullptr;
-  }
+static Function *get_function(StringRef Name) {
+  if (Function *F = TheModule->getFunction(Name)) return F;
 
-  unsigned Idx = 0;
-  for (Function::arg_iterator AI = F->arg_begin(); Idx != Arguments.size();
-       ++AI, ++Idx) {
-    AI->setName(Arguments[Idx]);
-    Named_Values[Arguments[Idx]] = AI;
+  unsigned NumArgs;
+  {
+    std::lock_guard<std::mutex> Lock(Session->Protos_Mutex);
+    auto Proto = Session->Function_Protos.find(Name);
+    if (Proto == Session->Function_Protos.end()) return nullptr;
+    NumArgs = Proto->second;
   }
 
-  return F;
+  std::vector<Type *> Integers(NumArgs, Type::getInt32Ty(*TheContext));
+  FunctionType *FT =
+      FunctionType::get(Type::getInt32Ty(*TheContext), Integers, false);
+  return Function::Create(FT, Function::ExternalLinkage, Name,
+                          TheModule.get());
 }
 
-Function *FunctionDefnAST::Codegen() {
-  Named_Values.clear();
-  Function *TheFunction = Func_Decl->Codegen();
+static Function *&operator_slot(bool Binary, char Op) {
+  Function **Table = Binary ? Binary_Operators : Unary_Operators;
+  return Table[(unsigned char)Op];
+}
 
-  if (!TheFunction) return nullptr;
-  if (Func_Decl->isBinaryOp())
-    Operator_Precedence[Func_Decl->getOperatorName()] =
-        Func_Decl->getBinaryPrecedence();
+static Function *get_operator_function(bool Binary, char Op) {
+  Function *&F = operator_slot(Binary, Op);
+  if (!F)
+    F = get_function((Twine(Binary ? "binary" : "unary") + Twine(Op)).str());
+  return F;
+}
 
-  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
+bool BaseAST::CodegenReturn() {
+  Value *RetVal = Codegen();
+  if (!RetVal) return false;
 
-  if (Value *RetVal = Body->Codegen()) {
-    Builder.CreateRet(RetVal);
-    verifyFunction(*TheFunction);
-    return TheFunction;
-  }
+  Builder->CreateRet(RetVal);
+  return true;
+}
 
+Value *NumericAST::Codegen() {
+  return ConstantInt::get(Type::getInt32Ty(*TheContext), numeric_val);
+}
+
+// Every variable lives in a stack slot of the entry block, where mem2reg at
+// -O1 and above turns it back into SSA registers.
+static AllocaInst *create_entry_block_alloca(Function *TheFunction,
+                                             StringRef Var_Name) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+                   TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Type::getInt32Ty(*TheContext), nullptr, Var_Name);
+}
+
+Value *VariableAST::Codegen() {
+  AllocaInst *A = Named_Values.lookup(Var_Name);
+  if (!A) return nullptr;
+  return Builder->CreateLoad(A->getAllocatedType(), A, Var_Name);
+}
+
+Value *ExprUnaryAST::Codegen() {
+  Value *OperandV = Operand->Codegen();
+  if (!OperandV) return nullptr;
+
+  Function *F = get_operator_function(false, Opcode);
+  if (!F) return nullptr;
+
+  return Builder->CreateCall(F, OperandV, "unop");
+}
+
+Value *BinaryAST::Codegen() {
+  Value *L = LHS->Codegen();
+  Value *R = RHS->Codegen();
+  if (!L || !R) return nullptr;
+
+  switch (Bin_Operator) {
+    case '+':
+      return Builder->CreateAdd(L, R, "addtmp");
+    case '-':
+      return Builder->CreateSub(L, R, "subtmp");
+    case '*':
+      return Builder->CreateMul(L, R, "multmp");
+    case '/':
+      return Builder->CreateSDiv(L, R, "divtmp");
+    case '<':
+      L = Builder->CreateICmpULT(L, R, "cmptmp");
+      return Builder->CreateZExt(L, Type::getInt32Ty(*TheContext), "booltmp");
+    default:
+      break;
+  }
+
+  Function *F = get_operator_function(true, Bin_Operator);
+  if (!F) return nullptr;
+
+  Value *Ops[2] = {L, R};
+
+  return Builder->CreateCall(F, Ops, "binop");
+}
+
+Value *ExprIfAST::Codegen() {
+  Value *Condtn = Cond->Codegen();
+  if (!Condtn) return nullptr;
+
+  Condtn = Builder->CreateICmpNE(
+      Condtn, ConstantInt::get(Type::getInt32Ty(*TheContext), 0), "ifcond");
+
+  Function *TheFunc = Builder->GetInsertBlock()->getParent();
+
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunc);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(*TheContext, "ifcont");
+
+  Builder->CreateCondBr(Condtn, ThenBB, ElseBB);
+  Builder->SetInsertPoint(ThenBB);
+
+  Value *ThenVal = Then->Codegen();
+  if (!ThenVal) return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  ThenBB = Builder->GetInsertBlock();
+
+  TheFunc->insert(TheFunc->end(), ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+
+  Value *ElseVal = Else->Codegen();
+  if (!ElseVal) return nullptr;
+
+  Builder->CreateBr(MergeBB);
+  ElseBB = Builder->GetInsertBlock();
+
+  TheFunc->insert(TheFunc->end(), MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+
+  PHINode *PN = Builder->CreatePHI(Type::getInt32Ty(*TheContext), 2, "iftmp");
+  PN->addIncoming(ThenVal, ThenBB);
+  PN->addIncoming(ElseVal, ElseBB);
+
+  return PN;
+}
+
+// In tail position each branch returns on its own, so there is no merge
+// block and a call at the end of a branch is directly followed by its ret.
+bool ExprIfAST::CodegenReturn() {
+  Value *Condtn = Cond->Codegen();
+  if (!Condtn) return false;
+
+  Condtn = Builder->CreateICmpNE(
+      Condtn, ConstantInt::get(Type::getInt32Ty(*TheContext), 0), "ifcond");
+
+  Function *TheFunc = Builder->GetInsertBlock()->getParent();
+
+  BasicBlock *ThenBB = BasicBlock::Create(*TheContext, "then", TheFunc);
+  BasicBlock *ElseBB = BasicBlock::Create(*TheContext, "else");
+
+  Builder->CreateCondBr(Condtn, ThenBB, ElseBB);
+  Builder->SetInsertPoint(ThenBB);
+  if (!Then->CodegenReturn()) return false;
+
+  TheFunc->insert(TheFunc->end(), ElseBB);
+  Builder->SetInsertPoint(ElseBB);
+  return Else->CodegenReturn();
+}
+
+Value *ExprForAST::Codegen() {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+  AllocaInst *Alloca = create_entry_block_alloca(TheFunction, Var_Name);
+
+  Value *StartVal = Start->Codegen();
+  if (!StartVal) return nullptr;
+  Builder->CreateStore(StartVal, Alloca);
+
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+
+  Builder->CreateBr(LoopBB);
+  Builder->SetInsertPoint(LoopBB);
+
+  AllocaInst *OldVal = Named_Values[Var_Name];
+  Named_Values[Var_Name] = Alloca;
+
+  if (!Body->Codegen()) return nullptr;
+
+  Value *StepVal;
+  if (Step) {
+    StepVal = Step->Codegen();
+    if (!StepVal) return nullptr;
+  } else {
+    StepVal = ConstantInt::get(Type::getInt32Ty(*TheContext), 1);
+  }
+
+  Value *EndCond = End->Codegen();
+  if (!EndCond) return nullptr;
+
+  // The body may have assigned the variable, so step from its current value.
+  Value *CurVar =
+      Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Var_Name);
+  Value *NextVar = Builder->CreateAdd(CurVar, StepVal, "nextvar");
+  Builder->CreateStore(NextVar, Alloca);
+
+  EndCond = Builder->CreateICmpNE(
+      EndCond, ConstantInt::get(Type::getInt32Ty(*TheContext), 0), "loopcond");
+
+  BasicBlock *AfterBB =
+      BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+  Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+  Builder->SetInsertPoint(AfterBB);
+
+  if (OldVal)
+    Named_Values[Var_Name] = OldVal;
+  else
+    Named_Values.erase(Var_Name);
+
+  return Constant::getNullValue(Type::getInt32Ty(*TheContext));
+}
+
+Value *AssignAST::Codegen() {
+  Value *Val = Value_Expr->Codegen();
+  if (!Val) return nullptr;
+
+  AllocaInst *A = Named_Values.lookup(Var_Name);
+  if (!A) return nullptr;
+
+  Builder->CreateStore(Val, A);
+  return Val;
+}
+
+// Each initializer is generated before its variable is in scope, so it sees
+// the variables declared before it and any outer one of its name.
+bool VarAST::bindVariables(SmallVectorImpl<AllocaInst *> &Old_Bindings) {
+  Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+  for (unsigned I = 0, E = Var_Names.size(); I != E; ++I) {
+    Value *InitVal = Inits[I]
+                         ? Inits[I]->Codegen()
+                         : ConstantInt::get(Type::getInt32Ty(*TheContext), 0);
+    if (!InitVal) return false;
+
+    AllocaInst *Alloca = create_entry_block_alloca(TheFunction, Var_Names[I]);
+    Builder->CreateStore(InitVal, Alloca);
+
+    Old_Bindings.push_back(Named_Values.lookup(Var_Names[I]));
+    Named_Values[Var_Names[I]] = Alloca;
+  }
+  return true;
+}
+
+void VarAST::restoreVariables(ArrayRef<AllocaInst *> Old_Bindings) {
+  for (unsigned I = Var_Names.size(); I != 0; --I) {
+    if (Old_Bindings[I - 1])
+      Named_Values[Var_Names[I - 1]] = Old_Bindings[I - 1];
+    else
+      Named_Values.erase(Var_Names[I - 1]);
+  }
+}
+
+Value *VarAST::Codegen() {
+  SmallVector<AllocaInst *, 4> Old_Bindings;
+  if (!bindVariables(Old_Bindings)) return nullptr;
+
+  Value *BodyVal = Body->Codegen();
+  if (!BodyVal) return nullptr;
+
+  restoreVariables(Old_Bindings);
+  return BodyVal;
+}
+
+bool VarAST::CodegenReturn() {
+  SmallVector<AllocaInst *, 4> Old_Bindings;
+  if (!bindVariables(Old_Bindings) || !Body->CodegenReturn()) return false;
+
+  restoreVariables(Old_Bindings);
+  return true;
+}
+
+CallInst *FunctionCallAST::CodegenCall() {
+  Function *CalleeF = get_function(Function_Callee);
+  if (!CalleeF || CalleeF->arg_size() != Function_Arguments.size())
+    return nullptr;
+
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0, e = Function_Arguments.size(); i != e; ++i) {
+    ArgsV.push_back(Function_Arguments[i]->Codegen());
+    if (!ArgsV.back()) return nullptr;
+  }
+
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  Call->setCallingConv(CalleeF->getCallingConv());
+  return Call;
+}
+
+Value *FunctionCallAST::Codegen() { return CodegenCall(); }
+
+// Toy code never takes the address of a local, so no callee can reach the
+// caller's frame and every call in tail position may reuse it. A call of the
+// function itself has the caller's prototype and calling convention, so it
+// can be musttail: the backend then always emits a jump, even at -O0, and
+// self recursion runs in constant stack space.
+bool FunctionCallAST::CodegenReturn() {
+  CallInst *Call = CodegenCall();
+  if (!Call) return false;
+
+  Function *Caller = Builder->GetInsertBlock()->getParent();
+  Call->setTailCallKind(Call->getCalledFunction() == Caller
+                            ? CallInst::TCK_MustTail
+                            : CallInst::TCK_Tail);
+  Builder->CreateRet(Call);
+  return true;
+}
+
+Function *FunctionDeclAST::Codegen() {
+  std::vector<Type *> Integers(Arguments.size(), Type::getInt32Ty(*TheContext));
+  FunctionType *FT =
+      FunctionType::get(Type::getInt32Ty(*TheContext), Integers, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, Func_Name,
+                                 TheModule.get());
+
+  if (F->getName() != Func_Name) {
+    F->eraseFromParent();
+    F = TheModule->getFunction(Func_Name);
+
+    if (!F->empty()) return nullptr;
+    if (F->arg_size() != Arguments.size()) return nullptr;
+  }
+
+  unsigned Idx = 0;
+  for (Function::arg_iterator AI = F->arg_begin(); Idx != Arguments.size();
+       ++AI, ++Idx)
+    AI->setName(Arguments[Idx]);
+
+  return F;
+}
+
+Function *FunctionDefnAST::Codegen() {
+  Named_Values.clear();
+  Function *TheFunction = Func_Decl->Codegen();
+
+  if (!TheFunction) return nullptr;
+  if (Func_Decl->isUnaryOp() || Func_Decl->isBinaryOp())
+    operator_slot(Func_Decl->isBinaryOp(), Func_Decl->getOperatorName()) =
+        TheFunction;
+
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+
+  // Arguments are variables like any other, so they can be assigned.
+  for (Argument &Arg : TheFunction->args()) {
+    AllocaInst *Alloca = create_entry_block_alloca(TheFunction, Arg.getName());
+    Builder->CreateStore(&Arg, Alloca);
+    Named_Values[Arg.getName()] = Alloca;
+  }
+
+  if (Body->CodegenReturn()) {
+    Num_IR_Instructions += TheFunction->getInstructionCount();
+    {
+      Phase_Timer Timer(PHASE_VERIFY);
+      verifyFunction(*TheFunction);
+    }
+    optimize_function(*TheFunction);
+    return TheFunction;
+  }
+
+  if (Func_Decl->isUnaryOp() || Func_Decl->isBinaryOp())
+    operator_slot(Func_Decl->isBinaryOp(), Func_Decl->getOperatorName()) =
+        nullptr;
   TheFunction->eraseFromParent();
   return nullptr;
 }
 
+// =======================
+// Interpreter
+// =======================
+
+static cl::opt<bool> Tiered(
+    "tiered", cl::init(false),
+    cl::desc("Interpret functions until they are hot, then JIT-compile them"));
+
+static cl::opt<unsigned> TierUpThreshold(
+    "tier-up-threshold", cl::init(1000),
+    cl::desc("Calls plus loop iterations after which -tiered compiles a "
+             "function"));
+
+// Variables visible while resolving a definition. A variable's frame slot is
+// its position in Names, so loop variables shadow earlier names and reuse
+// the slots of loops that have ended.
+struct Interp_Scope {
+  Tiered_Function *Function;
+  SmallVector<StringRef, 8> Names;
+  unsigned Frame_Size = 0;
+
+  bool lookup(StringRef Name, unsigned &Slot) const {
+    for (unsigned I = Names.size(); I != 0; --I) {
+      if (Names[I - 1] != Name) continue;
+      Slot = I - 1;
+      return true;
+    }
+    return false;
+  }
+
+  unsigned push(StringRef Name) {
+    Names.push_back(Name);
+    Frame_Size = std::max<unsigned>(Frame_Size, Names.size());
+    return Names.size() - 1;
+  }
+
+  void pop() { Names.pop_back(); }
+};
+
+// Fails exactly where FunctionCallAST::Codegen and get_operator_function do,
+// so a definition the interpreter accepts can always be compiled later.
+static Tiered_Function *resolve_callee(Interp_Scope &S, StringRef Name,
+                                       unsigned NumArgs) {
+  auto It = Session->Tiered_Functions.find(Name);
+  if (It == Session->Tiered_Functions.end() ||
+      It->second.Defn->getDecl()->getNumArgs() != NumArgs)
+    return nullptr;
+
+  S.Function->Callees.push_back(&It->second);
+  return &It->second;
+}
+
+// Name resolution is part of the front end, so it counts as parsing.
+static bool resolve_function(Tiered_Function &F) {
+  Phase_Timer Timer(PHASE_PARSE);
+  Interp_Scope S{&F};
+  for (StringRef Arg : F.Defn->getDecl()->getArgs()) S.push(Arg);
+
+  if (!F.Defn->getBody()->Resolve(S)) return false;
+  F.Frame_Size = S.Frame_Size;
+  return true;
+}
+
+static Error tier_up(Tiered_Function &F);
+
+// Compiles F once it is hot. If that fails it is reported once, and F keeps
+// being interpreted.
+static void tier_up_if_hot(Tiered_Function &F) {
+  if (F.Native || F.Tier_Up_Failed || ++F.Counter < TierUpThreshold) return;
+  if (Error Err = tier_up(F)) {
+    F.Tier_Up_Failed = true;
+    record_error(std::move(Err));
+  }
+}
+
+// Set by a self call in tail position once it has stored its arguments in
+// the caller's frame.
+static thread_local bool Tail_Call_Pending;
+
+static int interpret(Tiered_Function &F, ArrayRef<int> Args) {
+  SmallVector<int, 16> Frame(F.Frame_Size);
+  llvm::copy(Args, Frame.begin());
+
+  // Self tail calls rerun the body on the same frame, like the musttail
+  // calls of the generated code, so they do not grow the stack either.
+  while (true) {
+    int Result = F.Defn->getBody()->Evaluate(Frame.data());
+    if (!Tail_Call_Pending) return Result;
+
+    Tail_Call_Pending = false;
+    tier_up_if_hot(F);
+    if (F.Native) return F.Native(Frame.data());
+  }
+}
+
+static int call_function(Tiered_Function &F, ArrayRef<int> Args) {
+  tier_up_if_hot(F);
+  if (F.Native) return F.Native(Args.data());
+  return interpret(F, Args);
+}
+
+bool NumericAST::Resolve(Interp_Scope &) { return true; }
+
+int NumericAST::Evaluate(int *) { return numeric_val; }
+
+bool VariableAST::Resolve(Interp_Scope &S) { return S.lookup(Var_Name, Slot); }
+
+int VariableAST::Evaluate(int *Frame) { return Frame[Slot]; }
+
+bool ExprUnaryAST::Resolve(Interp_Scope &S) {
+  if (!Operand->Resolve(S)) return false;
+  Callee = resolve_callee(S, (Twine("unary") + Twine(Opcode)).str(), 1);
+  return Callee;
+}
+
+int ExprUnaryAST::Evaluate(int *Frame) {
+  int Arg = Operand->Evaluate(Frame);
+  return call_function(*Callee, Arg);
+}
+
+bool BinaryAST::Resolve(Interp_Scope &S) {
+  if (!LHS->Resolve(S) || !RHS->Resolve(S)) return false;
+
+  switch (Bin_Operator) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '<':
+      return true;
+    default:
+      Callee = resolve_callee(
+          S, (Twine("binary") + Twine(Bin_Operator)).str(), 2);
+      return Callee;
+  }
+}
+
+// Arithmetic is done on unsigned values so it wraps like the i32 operations
+// of the generated code.
+int BinaryAST::Evaluate(int *Frame) {
+  int L = LHS->Evaluate(Frame);
+  int R = RHS->Evaluate(Frame);
+
+  switch (Bin_Operator) {
+    case '+':
+      return (int)((unsigned)L + (unsigned)R);
+    case '-':
+      return (int)((unsigned)L - (unsigned)R);
+    case '*':
+      return (int)((unsigned)L * (unsigned)R);
+    case '/':
+      return L / R;
+    case '<':
+      return (unsigned)L < (unsigned)R;
+    default:
+      int Args[2] = {L, R};
+      return call_function(*Callee, Args);
+  }
+}
+
+bool ExprIfAST::Resolve(Interp_Scope &S) {
+  return Cond->Resolve(S) && Then->Resolve(S) && Else->Resolve(S);
+}
+
+int ExprIfAST::Evaluate(int *Frame) {
+  return Cond->Evaluate(Frame) ? Then->Evaluate(Frame) : Else->Evaluate(Frame);
+}
+
+bool ExprForAST::Resolve(Interp_Scope &S) {
+  if (!Start->Resolve(S)) return false;
+
+  Slot = S.push(Var_Name);
+  Owner = S.Function;
+  bool Resolved = Body->Resolve(S) && (!Step || Step->Resolve(S)) &&
+                  End->Resolve(S);
+  S.pop();
+  return Resolved;
+}
+
+// Mirrors the generated loop: the body runs before the end condition is
+// tested, the step and the condition see the value the body left in the
+// variable, and the step is added to that value. Iterations count towards
+// tiering up the enclosing function, which takes effect on its next call.
+int ExprForAST::Evaluate(int *Frame) {
+  Frame[Slot] = Start->Evaluate(Frame);
+  while (true) {
+    Body->Evaluate(Frame);
+    int StepVal = Step ? Step->Evaluate(Frame) : 1;
+    int EndCond = End->Evaluate(Frame);
+    Frame[Slot] = (int)((unsigned)Frame[Slot] + (unsigned)StepVal);
+    ++Owner->Counter;
+    if (!EndCond) return 0;
+  }
+}
+
+bool AssignAST::Resolve(Interp_Scope &S) {
+  return Value_Expr->Resolve(S) && S.lookup(Var_Name, Slot);
+}
+
+int AssignAST::Evaluate(int *Frame) {
+  return Frame[Slot] = Value_Expr->Evaluate(Frame);
+}
+
+// The variables get consecutive slots, each pushed after its initializer is
+// resolved, like VarAST::Codegen binds them.
+bool VarAST::Resolve(Interp_Scope &S) {
+  for (unsigned I = 0, E = Var_Names.size(); I != E; ++I) {
+    if (Inits[I] && !Inits[I]->Resolve(S)) return false;
+    unsigned Slot = S.push(Var_Names[I]);
+    if (I == 0) First_Slot = Slot;
+  }
+
+  bool Resolved = Body->Resolve(S);
+  for (unsigned I = 0, E = Var_Names.size(); I != E; ++I) S.pop();
+  return Resolved;
+}
+
+int VarAST::Evaluate(int *Frame) {
+  for (unsigned I = 0, E = Var_Names.size(); I != E; ++I)
+    Frame[First_Slot + I] = Inits[I] ? Inits[I]->Evaluate(Frame) : 0;
+  return Body->Evaluate(Frame);
+}
+
+bool FunctionCallAST::Resolve(Interp_Scope &S) {
+  for (BaseAST *Arg : Function_Arguments)
+    if (!Arg->Resolve(S)) return false;
+
+  Callee = resolve_callee(S, Function_Callee, Function_Arguments.size());
+  Is_Self_Tail = Is_Tail && Callee == S.Function;
+  return Callee;
+}
+
+int FunctionCallAST::Evaluate(int *Frame) {
+  SmallVector<int, 8> Args;
+  for (BaseAST *Arg : Function_Arguments) Args.push_back(Arg->Evaluate(Frame));
+
+  if (Is_Self_Tail) {
+    llvm::copy(Args, Frame);
+    Tail_Call_Pending = true;
+    return 0;
+  }
+  return call_function(*Callee, Args);
+}
+
+// Adds "<name>.entry", which takes the arguments of F as an array, so the
+// interpreter and -batch-run can call a compiled function of any arity
+// through one pointer type. Toy identifiers never contain a '.'.
+static void emit_tier_entry(Function &F) {
+  Type *Int32 = Type::getInt32Ty(*TheContext);
+  FunctionType *FT =
+      FunctionType::get(Int32, {PointerType::getUnqual(*TheContext)}, false);
+  Function *Entry = Function::Create(FT, Function::ExternalLinkage,
+                                     F.getName() + ".entry", TheModule.get());
+
+  Builder->SetInsertPoint(BasicBlock::Create(*TheContext, "entry", Entry));
+  Value *Args = Entry->getArg(0);
+  SmallVector<Value *, 8> ArgsV;
+  for (unsigned I = 0, E = F.arg_size(); I != E; ++I) {
+    Value *Addr = Builder->CreateConstInBoundsGEP1_32(Int32, Args, I);
+    ArgsV.push_back(Builder->CreateLoad(Int32, Addr));
+  }
+  Builder->CreateRet(Builder->CreateCall(&F, ArgsV));
+}
+
+// =======================
+// Memoization
+// =======================
+
+static cl::opt<bool> Memoize(
+    "memoize", cl::init(false),
+    cl::desc("Cache the results of every function of up to four arguments"));
+
+static cl::opt<unsigned> MemoEntries(
+    "memo-entries", cl::init(4096),
+    cl::desc("Entries in each -memoize cache, rounded up to a power of two"));
+
+static constexpr unsigned MAX_MEMO_ARGS = 4;
+
+// One slot of a direct-mapped result cache. Sequence is a seqlock: odd while
+// a writer fills the slot, even and non-zero once it holds a result, so
+// readers on any thread never act on a half-written entry, and no thread
+// ever waits for another.
+struct Memo_Entry {
+  std::atomic<uint32_t> Sequence;
+  std::atomic<int32_t> Args[MAX_MEMO_ARGS];
+  std::atomic<int32_t> Value;
+};
+
+static uint32_t memo_index(const int32_t *Args, uint32_t NumArgs) {
+  uint32_t Hash = 0;
+  for (uint32_t I = 0; I != NumArgs; ++I) {
+    Hash = (Hash ^ (uint32_t)Args[I]) * 0x9E3779B1u;
+    Hash ^= Hash >> 16;
+  }
+  return Hash & (PowerOf2Ceil(MemoEntries) - 1);
+}
+
+// Called by the generated wrappers. Table points to the wrapper's
+// "<name>.memo" global, which stays null until the first result is stored,
+// so functions that never run cost no memory.
+extern "C" int32_t toy_memo_lookup(std::atomic<Memo_Entry *> *Table,
+                                   const int32_t *Args, uint32_t NumArgs,
+                                   int32_t *Result) {
+  Memo_Entry *Entries = Table->load(std::memory_order_acquire);
+  if (!Entries) return 0;
+
+  Memo_Entry &E = Entries[memo_index(Args, NumArgs)];
+  uint32_t Sequence = E.Sequence.load(std::memory_order_acquire);
+  if (Sequence == 0 || Sequence & 1) return 0;
+
+  bool Match = true;
+  for (uint32_t I = 0; I != NumArgs; ++I)
+    Match &= E.Args[I].load(std::memory_order_relaxed) == Args[I];
+  int32_t Value = E.Value.load(std::memory_order_relaxed);
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!Match || E.Sequence.load(std::memory_order_relaxed) != Sequence)
+    return 0;
+
+  *Result = Value;
+  return 1;
+}
+
+extern "C" void toy_memo_store(std::atomic<Memo_Entry *> *Table,
+                               const int32_t *Args, uint32_t NumArgs,
+                               int32_t Value) {
+  Memo_Entry *Entries = Table->load(std::memory_order_acquire);
+  if (!Entries) {
+    auto *New_Entries = new Memo_Entry[PowerOf2Ceil(MemoEntries)]();
+    if (Table->compare_exchange_strong(Entries, New_Entries,
+                                       std::memory_order_acq_rel))
+      Entries = New_Entries;
+    else
+      delete[] New_Entries;
+  }
+
+  // A slot another thread is writing is skipped: the cache may drop a result
+  // but never blocks.
+  Memo_Entry &E = Entries[memo_index(Args, NumArgs)];
+  uint32_t Sequence = E.Sequence.load(std::memory_order_relaxed);
+  if (Sequence & 1 ||
+      !E.Sequence.compare_exchange_strong(Sequence, Sequence + 1,
+                                          std::memory_order_acquire))
+    return;
+
+  for (uint32_t I = 0; I != NumArgs; ++I)
+    E.Args[I].store(Args[I], std::memory_order_relaxed);
+  E.Value.store(Value, std::memory_order_relaxed);
+  E.Sequence.store(Sequence + 2, std::memory_order_release);
+}
+
+static bool is_memoizable(const FunctionDeclAST &Decl, const Function &F) {
+  // Operators are left alone: they are small enough that a lookup costs more
+  // than calling them.
+  if (Decl.isUnaryOp() || Decl.isBinaryOp() ||
+      Decl.getNumArgs() > MAX_MEMO_ARGS)
+    return false;
+
+  // Neither are functions that call themselves in tail position. That
+  // recursion already runs as a loop, and storing each result after the call
+  // returns would turn it back into one stack frame per call.
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        if (Call->isMustTailCall()) return false;
+  return true;
+}
+
+// Renames Impl to "<name>.impl" and puts a wrapper of the original name in
+// front of it, which looks the arguments up in the cache and only calls
+// Impl on a miss. Impl's own recursive calls are redirected to the wrapper,
+// so they hit the cache too. Toy functions have no side effects, which is
+// what makes this valid.
+//
+// Neither function gets memory(none) or willreturn, although callers cannot
+// tell the difference. The wrapper writes the table, and so does Impl
+// through its calls of the wrapper; a function that accesses memory its
+// attributes deny has undefined behavior. And a toy loop or recursion need
+// not terminate.
+static Function *memoize_function(Function &Impl) {
+  std::string Name = Impl.getName().str();
+  Impl.setName(Name + ".impl");
+
+  Function *Wrapper = Function::Create(
+      Impl.getFunctionType(), Function::ExternalLinkage, Name, TheModule.get());
+  Impl.replaceAllUsesWith(Wrapper);
+
+  Type *Int32 = Type::getInt32Ty(*TheContext);
+  Type *Ptr = PointerType::getUnqual(*TheContext);
+  FunctionCallee Lookup = TheModule->getOrInsertFunction(
+      "toy_memo_lookup", Int32, Ptr, Ptr, Int32, Ptr);
+  FunctionCallee Store = TheModule->getOrInsertFunction(
+      "toy_memo_store", Type::getVoidTy(*TheContext), Ptr, Ptr, Int32, Int32);
+  auto *Table = new GlobalVariable(
+      *TheModule, Ptr, /*isConstant=*/false, GlobalValue::ExternalLinkage,
+      Constant::getNullValue(Ptr), Name + ".memo");
+
+  BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", Wrapper);
+  BasicBlock *HitBB = BasicBlock::Create(*TheContext, "hit", Wrapper);
+  BasicBlock *MissBB = BasicBlock::Create(*TheContext, "miss", Wrapper);
+
+  Builder->SetInsertPoint(EntryBB);
+  unsigned NumArgs = Wrapper->arg_size();
+  Value *Args = Builder->CreateAlloca(ArrayType::get(Int32, NumArgs), nullptr,
+                                      "args");
+  Value *Result = Builder->CreateAlloca(Int32, nullptr, "result");
+  SmallVector<Value *, MAX_MEMO_ARGS> ArgsV;
+  for (Argument &Arg : Wrapper->args()) {
+    Arg.setName(Impl.getArg(Arg.getArgNo())->getName());
+    Value *Addr =
+        Builder->CreateConstInBoundsGEP2_32(ArrayType::get(Int32, NumArgs),
+                                            Args, 0, Arg.getArgNo());
+    Builder->CreateStore(&Arg, Addr);
+    ArgsV.push_back(&Arg);
+  }
+  Value *NumArgsV = ConstantInt::get(Int32, NumArgs);
+  Value *Hit = Builder->CreateCall(Lookup, {Table, Args, NumArgsV, Result});
+  Builder->CreateCondBr(Builder->CreateICmpNE(Hit, ConstantInt::get(Int32, 0)),
+                        HitBB, MissBB);
+
+  Builder->SetInsertPoint(HitBB);
+  Builder->CreateRet(Builder->CreateLoad(Int32, Result));
+
+  Builder->SetInsertPoint(MissBB);
+  Value *Computed = Builder->CreateCall(&Impl, ArgsV, "value");
+  Builder->CreateCall(Store, {Table, Args, NumArgsV, Computed});
+  Builder->CreateRet(Computed);
+
+  verifyFunction(*Wrapper);
+  return Wrapper;
+}
+
+// =======================
+// Batch Evaluation
+// =======================
+
+static cl::opt<bool> Batch(
+    "batch", cl::init(false),
+    cl::desc("Also generate <name>.batch, which evaluates a function over "
+             "arrays of arguments"));
+
+static cl::opt<std::string> BatchRun(
+    "batch-run", cl::value_desc("function"),
+    cl::desc("After the program, evaluate this function over -batch-rows "
+             "argument rows, batched and call by call; only it gets a "
+             "batch form"));
+
+static cl::opt<unsigned> BatchRows("batch-rows", cl::init(1 << 20),
+                                   cl::desc("Rows evaluated by -batch-run"));
+
+// The signature of "<name>.batch": Columns holds one array per argument of
+// the function, and row I of those arrays is evaluated into Out[I].
+using Toy_Batch_Function = void (*)(int32_t *Out,
+                                    const int32_t *const *Columns,
+                                    int32_t Rows);
+
+// The optimization pipeline plus the loop vectorizer, which turns the row
+// loop into one that evaluates several rows per iteration.
+static thread_local std::unique_ptr<FunctionPassManager> Batch_FPM;
+
+// Adds "<name>.batch", a loop over the rows that evaluates an inlined copy
+// of F for each. Rows are independent and Out aliases no argument array, so
+// once F's body is straight-line code, the vectorizer gives every SIMD lane
+// its own row. Bodies with loops or calls stay scalar but still save the
+// indirect call per row.
+static Function *emit_batch_function(Function &F) {
+  Type *Int32 = Type::getInt32Ty(*TheContext);
+  Type *Int64 = Type::getInt64Ty(*TheContext);
+  Type *Ptr = PointerType::getUnqual(*TheContext);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext),
+                                       {Ptr, Ptr, Int32}, false);
+  Function *BatchF = Function::Create(FT, Function::ExternalLinkage,
+                                      F.getName() + ".batch", TheModule.get());
+  Argument *Out = BatchF->getArg(0);
+  Argument *Columns = BatchF->getArg(1);
+  Argument *Rows = BatchF->getArg(2);
+  Out->setName("out");
+  Columns->setName("columns");
+  Rows->setName("rows");
+  BatchF->addParamAttr(0, Attribute::NoAlias);
+
+  BasicBlock *EntryBB = BasicBlock::Create(*TheContext, "entry", BatchF);
+  BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "row", BatchF);
+  BasicBlock *ExitBB = BasicBlock::Create(*TheContext, "done", BatchF);
+
+  Builder->SetInsertPoint(EntryBB);
+  SmallVector<Value *, 8> Column_Ptrs;
+  for (unsigned I = 0, E = F.arg_size(); I != E; ++I)
+    Column_Ptrs.push_back(Builder->CreateLoad(
+        Ptr, Builder->CreateConstInBoundsGEP1_32(Ptr, Columns, I),
+        F.getArg(I)->getName()));
+  Value *End = Builder->CreateZExt(Rows, Int64, "end");
+  Builder->CreateCondBr(
+      Builder->CreateICmpSGT(Rows, ConstantInt::get(Int32, 0)), LoopBB,
+      ExitBB);
+
+  Builder->SetInsertPoint(LoopBB);
+  PHINode *Row = Builder->CreatePHI(Int64, 2, "i");
+  Row->addIncoming(ConstantInt::get(Int64, 0), EntryBB);
+  SmallVector<Value *, 8> ArgsV;
+  for (Value *Column : Column_Ptrs)
+    ArgsV.push_back(Builder->CreateLoad(
+        Int32, Builder->CreateInBoundsGEP(Int32, Column, Row)));
+  CallInst *Call = Builder->CreateCall(&F, ArgsV, "value");
+  Builder->CreateStore(Call, Builder->CreateInBoundsGEP(Int32, Out, Row));
+  Value *Next = Builder->CreateAdd(Row, ConstantInt::get(Int64, 1), "next",
+                                   /*HasNUW=*/true, /*HasNSW=*/true);
+  Row->addIncoming(Next, LoopBB);
+  Builder->CreateCondBr(Builder->CreateICmpULT(Next, End), LoopBB, ExitBB);
+
+  Builder->SetInsertPoint(ExitBB);
+  Builder->CreateRetVoid();
+
+  InlineFunctionInfo IFI;
+  InlineFunction(*Call, IFI);
+  verifyFunction(*BatchF);
+
+  if (OptLevel < 2) {
+    optimize_function(*BatchF);
+    return BatchF;
+  }
+  if (!Batch_FPM) {
+    Batch_FPM = std::make_unique<FunctionPassManager>();
+    add_optimization_passes(*Batch_FPM);
+    Batch_FPM->addPass(LoopVectorizePass());
+    Batch_FPM->addPass(InstCombinePass());
+    Batch_FPM->addPass(SimplifyCFGPass());
+  }
+  run_function_passes(*Batch_FPM, *BatchF);
+  return BatchF;
+}
+
+// -batch builds the batch form of every definition, -batch-run only that of
+// the function it runs.
+static bool wants_batch_function(StringRef Name) {
+  return BatchRun.empty() ? Batch : Name == BatchRun;
+}
+
+static Expected<Toy_Batch_Function> lookup_batch_function(StringRef Name) {
+  Expected<orc::ExecutorAddr> Addr =
+      Session->JIT->lookup((Name + ".batch").str());
+  if (!Addr) return Addr.takeError();
+  return Addr->toPtr<Toy_Batch_Function>();
+}
+
 // =======================
 // Driver
 // =======================
 
-static ExecutionEngine *TheExecutionEngine;
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input-file>"));
+
+static cl::opt<unsigned> Codegen_Threads(
+    "j", cl::Prefix, cl::init(1),
+    cl::desc("Number of threads generating code for definitions"));
+
+static cl::opt<bool> PrintIR("print-ir", cl::init(true),
+                             cl::desc("Print the IR of every definition"));
+
+static cl::opt<unsigned> Sessions(
+    "sessions", cl::init(1),
+    cl::desc("Run the program in this many concurrent sessions and check "
+             "that they agree"));
+
+static cl::opt<bool> Watch(
+    "watch", cl::init(false),
+    cl::desc("Keep running, and whenever the input file changes, compile "
+             "the definitions that changed and run the program again"));
+
+// Definitions keep the C calling convention with 32-bit int arguments, so C
+// declares each one with its exact arity: def f(a b) is int f(int, int).
+// Variadic prototypes pass arguments differently on some targets.
+static cl::opt<bool> EmitObject(
+    "c", cl::init(false),
+    cl::desc("Compile the definitions to an object file instead of running "
+             "the program; top-level expressions are skipped"));
+
+static cl::opt<std::string> OutputFilename(
+    "o", cl::value_desc("filename"),
+    cl::desc("Object file written by -c (default: <input-file>.o)"));
+
+static std::mutex Output_Mutex;
+
+static void print_function(const Function &F) {
+  if (!Session->Print_IR) return;
+
+  std::string IR;
+  raw_string_ostream OS(IR);
+  F.print(OS);
+
+  std::lock_guard<std::mutex> Lock(Output_Mutex);
+  outs() << IR;
+}
+
+static void codegen_definition(FunctionDefnAST *F,
+                               orc::ResourceTrackerSP Tracker = nullptr) {
+  if (!TheModule) InitializeModule();
+
+  Function *LF;
+  {
+    Phase_Timer Timer(PHASE_CODEGEN);
+    LF = F->Codegen();
+  }
+  if (!LF) {
+    forget_function(F->getDecl()->getName());
+    record_failure(
+        "definition of " + F->getDecl()->getName() + " did not compile",
+        Tracker);
+    // The declarations it made could clash with the next definition
+    // generated on this thread, unless they all go into one object file.
+    if (!EmitObject) InitializeModule();
+    return;
+  }
+  if (Memoize && is_memoizable(*F->getDecl(), *LF)) {
+    Function *Wrapper = memoize_function(*LF);
+    print_function(*LF);
+    LF = Wrapper;
+  }
+  print_function(*LF);
+  if (wants_batch_function(LF->getName()))
+    print_function(*emit_batch_function(*LF));
+
+  // An object file is written from one module holding every definition.
+  if (EmitObject) return;
+  if (Tiered || LF->getName() == BatchRun) emit_tier_entry(*LF);
+
+  // Definitions are compiled lazily, on their first call. A tracked module
+  // is compiled whole, on the first lookup of any of its symbols, so that
+  // removing the tracker removes all of its code.
+  run_plugin_passes(*TheModule);
+  orc::ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+  if (Tracker)
+    record_error(Session->JIT->addIRModule(Tracker, std::move(TSM)));
+  else
+    record_error(Session->JIT->addLazyIRModule(std::move(TSM)));
+  InitializeModule();
+}
+
+// Compiles F and everything it may call, since compiled code can only call
+// compiled functions. Callees go into the JIT lazily and keep being
+// interpreted until they are hot themselves.
+static Error tier_up(Tiered_Function &F) {
+  SmallVector<Tiered_Function *, 8> Worklist = {&F};
+  while (!Worklist.empty()) {
+    Tiered_Function *T = Worklist.pop_back_val();
+    if (T->In_JIT) continue;
+
+    T->In_JIT = true;
+    codegen_definition(T->Defn);
+    Worklist.append(T->Callees.begin(), T->Callees.end());
+  }
+
+  StringRef Name = F.Defn->getDecl()->getName();
+  auto EntryAddr = Session->JIT->lookup((Name + ".entry").str());
+  if (!EntryAddr) return EntryAddr.takeError();
+  F.Native = EntryAddr->toPtr<int (*)(const int *)>();
+  return Error::success();
+}
+
+static void define_tiered_function(FunctionDefnAST *F,
+                                   std::shared_ptr<BumpPtrAllocator> Arena) {
+  StringRef Name = F->getDecl()->getName();
+  Tiered_Function &T = Session->Tiered_Functions[Name];
+  T.Defn = F;
+  T.Arena = std::move(Arena);
+
+  if (!resolve_function(T)) {
+    record_failure("definition of " + Name + " did not compile");
+    Session->Tiered_Functions.erase(Name);
+    forget_function(Name);
+  }
+}
+
+// Simplifying the tree is part of the front end, so it counts as parsing.
+static void simplify_definition(FunctionDefnAST *F) {
+  if (OptLevel == 0) return;
+
+  Phase_Timer Timer(PHASE_PARSE);
+  F->Simplify();
+}
+
+// Decides whether an incremental session has to compile the definition F,
+// whose tree lives in Arena. If so, Tracker is set to own the new code and
+// Replaced to the tracker of the earlier version, which replace_definition
+// removes.
+static bool needs_codegen(FunctionDefnAST *F,
+                          const std::shared_ptr<BumpPtrAllocator> &Arena,
+                          orc::ResourceTrackerSP &Tracker,
+                          orc::ResourceTrackerSP &Replaced) {
+  StringRef Name = F->getDecl()->getName();
+  StringSet<> Callees;
+  F->getBody()->addCallees(Callees);
+
+  auto [It, Inserted] = Session->Definitions.try_emplace(Name);
+  Definition_Record &R = It->second;
+  // A name defined twice in one program keeps its first definition.
+  if (!Inserted && R.Generation == Session->Generation) return true;
+  R.Generation = Session->Generation;
+
+  // Also compiled again if the last version failed to generate. Changed
+  // callees have already compiled it again, in replace_definition.
+  if (!Inserted && R.Token_Hash == Token_Hash) {
+    std::lock_guard<std::mutex> Lock(Session->Protos_Mutex);
+    if (Session->Function_Protos.count(Name)) return false;
+  }
+
+  // replace_definition may have compiled it again already, on a task that
+  // could still add to the tracker or forget the function.
+  if (Session->Recompiled.contains(Name) && Session->Codegen_Pool)
+    Session->Codegen_Pool->wait();
+  Replaced = std::move(R.Tracker);
+  forget_function(Name);
+  Session->Inline_Operators.erase(Name);
+
+  for (const auto &Callee : R.Callees)
+    Session->Callers[Callee.getKey()].erase(Name);
+  for (const auto &Callee : Callees)
+    Session->Callers[Callee.getKey()].insert(Name);
+  R.Token_Hash = Token_Hash;
+  R.Callees = std::move(Callees);
+  R.Defn = new (*AST_Arena)
+      FunctionDefnAST(F->getDecl(), F->getBody()->Clone({}));
+  R.Arena = Arena;
+  R.Tracker = Tracker =
+      Session->JIT->getMainJITDylib().createResourceTracker();
+  Session->Recompiled.insert(Name);
+  return true;
+}
+
+static void generate_definition(FunctionDefnAST *F,
+                                std::shared_ptr<BumpPtrAllocator> Arena,
+                                orc::ResourceTrackerSP Tracker) {
+  if (!Session->Codegen_Pool) {
+    codegen_definition(F, std::move(Tracker));
+    return;
+  }
+
+  // The task keeps the arena alive until the tree has been generated.
+  Session->Codegen_Pool->async([S = Session, F, Arena, Tracker] {
+    Session_Scope Scope(*S);
+    codegen_definition(F, Tracker);
+  });
+}
+
+// Compiles the definition Name of an incremental session again from the
+// tree it was parsed to, replacing its code.
+static void recompile_definition(StringRef Name) {
+  Definition_Record &R = Session->Definitions[Name];
+  if (R.Tracker) record_error(R.Tracker->remove());
+  Session->Inline_Operators.erase(Name);
+  R.Tracker = Session->JIT->getMainJITDylib().createResourceTracker();
+  Session->Recompiled.insert(Name);
+
+  BumpPtrAllocator *Saved_Arena = AST_Arena;
+  AST_Arena = R.Arena.get();
+  FunctionDeclAST *Decl = R.Defn->getDecl();
+  auto *F = new (*AST_Arena)
+      FunctionDefnAST(Decl, R.Defn->getBody()->Clone({}));
+  // Its prototype is gone if the last version failed to generate.
+  declare_function(Name, Decl->getNumArgs());
+  simplify_definition(F);
+  if (OptLevel > 0 && (Decl->isUnaryOp() || Decl->isBinaryOp()))
+    register_inline_operator(F, R.Arena);
+  generate_definition(F, R.Arena, R.Tracker);
+  AST_Arena = Saved_Arena;
+}
+
+// Compiles every definition that calls Name, directly or not, again and
+// only then removes Replaced, the code of Name's earlier version, so no
+// code is left that calls into it. Callers are compiled nearest first, so
+// that operators are inlined in their new versions.
+static void replace_definition(StringRef Name,
+                               orc::ResourceTrackerSP Replaced) {
+  std::vector<std::string> Callers = {Name.str()};
+  StringSet<> Seen = {Name};
+  for (size_t I = 0; I < Callers.size(); ++I) {
+    auto It = Session->Callers.find(Callers[I]);
+    if (It == Session->Callers.end()) continue;
+    for (const auto &Caller : It->second)
+      if (Seen.insert(Caller.getKey()).second)
+        Callers.push_back(Caller.getKey().str());
+  }
+
+  // A pending task may still add the code of a caller to its tracker.
+  if (Callers.size() > 1 && Session->Codegen_Pool)
+    Session->Codegen_Pool->wait();
+  for (size_t I = 1; I < Callers.size(); ++I)
+    recompile_definition(Callers[I]);
+  if (Replaced) record_error(Replaced->remove());
+}
+
+// Removes the definitions of earlier programs that the current one no
+// longer has. Their callers are compiled again without them, and fail if
+// they still call them.
+static void remove_missing_definitions() {
+  std::vector<std::string> Missing;
+  for (const auto &Entry : Session->Definitions)
+    if (Entry.second.Generation != Session->Generation)
+      Missing.push_back(Entry.getKey().str());
+
+  for (const std::string &Name : Missing) {
+    for (const auto &Callee : Session->Definitions[Name].Callees)
+      Session->Callers[Callee.getKey()].erase(Name);
+    forget_function(Name);
+    Session->Inline_Operators.erase(Name);
+  }
+  for (const std::string &Name : Missing) {
+    replace_definition(Name, std::move(Session->Definitions[Name].Tracker));
+    Session->Definitions.erase(Name);
+  }
+}
 
 static void HandleDefn() {
-  if (FunctionDefnAST *F = func_defn_parser()) {
-    if (Function *LF = F->Codegen()) {
-    }
-  } else {
+  auto Arena = std::make_shared<BumpPtrAllocator>();
+  AST_Arena = Arena.get();
+
+  FunctionDefnAST *F;
+  {
+    Phase_Timer Timer(PHASE_PARSE);
+    Token_Hash = hash_code(0);
+    F = func_defn_parser();
+  }
+  if (!F) {
+    record_failure("a definition did not parse");
     next_token();
+    return;
+  }
+
+  orc::ResourceTrackerSP Tracker, Replaced;
+  if (Session->Incremental && !needs_codegen(F, Arena, Tracker, Replaced))
+    return;
+
+  // Register the prototype and precedence right away: later definitions may
+  // call this one, or use it as an operator, before its code exists.
+  FunctionDeclAST *Decl = F->getDecl();
+  if (!declare_function(Decl->getName(), Decl->getNumArgs())) {
+    {
+      std::lock_guard<std::mutex> Lock(Output_Mutex);
+      errs() << "redefinition of " << Decl->getName() << "\n";
+    }
+    record_failure("redefinition of " + Decl->getName());
+    return;
   }
+  if (Decl->isBinaryOp())
+    Session->Operator_Precedence[Decl->getOperatorName()] =
+        Decl->getBinaryPrecedence();
+
+  simplify_definition(F);
+  if (OptLevel > 0 && (Decl->isUnaryOp() || Decl->isBinaryOp()))
+    register_inline_operator(F, Arena);
+
+  if (Tiered && !EmitObject) {
+    define_tiered_function(F, std::move(Arena));
+    return;
+  }
+
+  if (Session->Incremental)
+    replace_definition(Decl->getName(), std::move(Replaced));
+  generate_definition(F, std::move(Arena), std::move(Tracker));
+}
+
+static void record_result(int Result) {
+  Session->Results.push_back(Result);
+  if (Session->Print_Results) outs() << "Evaluated to " << Result << "\n";
 }
 
 static void HandleTopLevelExpression() {
-  if (FunctionDefnAST *F = top_level_parser()) {
-    if (Function *LF = F->Codegen()) {
-      void *FPtr = TheExecutionEngine->getPointerToFunction(LF);
-      int (*Int)() = (int (*)())(intptr_t)FPtr;
-      printf("Evaluated to %d\n", Int());
-    }
-  } else {
+  BumpPtrAllocator Arena;
+  AST_Arena = &Arena;
+
+  FunctionDefnAST *F;
+  {
+    Phase_Timer Timer(PHASE_PARSE);
+    F = top_level_parser();
+  }
+  if (!F) {
+    record_failure("a top-level expression did not parse");
     next_token();
+    return;
+  }
+  if (EmitObject) return;
+  simplify_definition(F);
+
+  // Top-level expressions run once, so they are never compiled when tiered.
+  if (Tiered) {
+    Tiered_Function T;
+    T.Defn = F;
+    if (!resolve_function(T)) {
+      record_failure("a top-level expression did not compile");
+      return;
+    }
+
+    int Result;
+    {
+      Phase_Timer Timer(PHASE_EXECUTE);
+      Result = interpret(T, {});
+    }
+    record_result(Result);
+    return;
+  }
+
+  // Every definition the expression may call has to be in the JIT first.
+  if (Session->Codegen_Pool) Session->Codegen_Pool->wait();
+
+  Function *LF;
+  {
+    Phase_Timer Timer(PHASE_CODEGEN);
+    LF = F->Codegen();
+  }
+  if (!LF) {
+    record_failure("a top-level expression did not compile");
+    InitializeModule();
+    return;
+  }
+  print_function(*LF);
+
+  // Top-level expressions run exactly once, so they are compiled eagerly and
+  // their code is dropped as soon as they return.
+  run_plugin_passes(*TheModule);
+  orc::ResourceTrackerSP RT =
+      Session->JIT->getMainJITDylib().createResourceTracker();
+  Error Err = Session->JIT->addIRModule(
+      RT, orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+  InitializeModule();
+  if (Err) {
+    record_error(std::move(Err));
+    return;
+  }
+
+  auto ExprAddr = Session->JIT->lookup("__anon_expr");
+  if (!ExprAddr) {
+    record_error(ExprAddr.takeError());
+    record_error(RT->remove());
+    return;
+  }
+  int (*Int)() = ExprAddr->toPtr<int (*)()>();
+  int Result;
+  {
+    Phase_Timer Timer(PHASE_EXECUTE);
+    Result = Int();
   }
+  record_result(Result);
+
+  record_error(RT->remove());
+}
+
+// Evaluates Name over BatchRows generated rows, first through its batch
+// function and then with one call per row, and reports both times.
+static Error run_batch(StringRef Name) {
+  unsigned NumArgs;
+  {
+    std::lock_guard<std::mutex> Lock(Session->Protos_Mutex);
+    auto Proto = Session->Function_Protos.find(Name);
+    if (Proto == Session->Function_Protos.end())
+      return make_error<StringError>("-batch-run: no function " + Name,
+                                     inconvertibleErrorCode());
+    NumArgs = Proto->second;
+  }
+
+  // Functions the interpreter is still running are compiled first.
+  if (Tiered) {
+    auto It = Session->Tiered_Functions.find(Name);
+    if (It != Session->Tiered_Functions.end() && !It->second.Native)
+      if (Error Err = tier_up(It->second)) return Err;
+  }
+
+  std::vector<std::vector<int32_t>> Columns(NumArgs,
+                                            std::vector<int32_t>(BatchRows));
+  std::vector<const int32_t *> Column_Ptrs;
+  SmallVector<int, 8> Args(NumArgs);
+  for (unsigned K = 0; K != NumArgs; ++K) {
+    // Arguments start at 1, so functions that divide by one do not trap.
+    for (unsigned I = 0; I != BatchRows; ++I)
+      Columns[K][I] = (int32_t)((I * (K + 1)) % 64 + 1);
+    Column_Ptrs.push_back(Columns[K].data());
+    Args[K] = Columns[K][0];
+  }
+
+  Expected<Toy_Batch_Function> BatchF = lookup_batch_function(Name);
+  if (!BatchF) return BatchF.takeError();
+  auto EntryAddr = Session->JIT->lookup((Name + ".entry").str());
+  if (!EntryAddr) return EntryAddr.takeError();
+  auto *Entry = EntryAddr->toPtr<int (*)(const int *)>();
+
+  // The first calls compile both functions, so they are not timed.
+  std::vector<int32_t> Batched(BatchRows), Called(BatchRows);
+  (*BatchF)(Batched.data(), Column_Ptrs.data(), 0);
+  Entry(Args.data());
+
+  auto Start = std::chrono::steady_clock::now();
+  {
+    Phase_Timer Timer(PHASE_EXECUTE);
+    (*BatchF)(Batched.data(), Column_Ptrs.data(), BatchRows);
+  }
+  auto Middle = std::chrono::steady_clock::now();
+  {
+    Phase_Timer Timer(PHASE_EXECUTE);
+    for (unsigned I = 0; I != BatchRows; ++I) {
+      for (unsigned K = 0; K != NumArgs; ++K) Args[K] = Columns[K][I];
+      Called[I] = Entry(Args.data());
+    }
+  }
+  auto End = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double, std::milli> Batched_Ms = Middle - Start;
+  std::chrono::duration<double, std::milli> Called_Ms = End - Middle;
+  outs() << "Batch " << Name << " over " << BatchRows << " rows: "
+         << format("%.3f ms batched, %.3f ms called one by one",
+                   Batched_Ms.count(), Called_Ms.count())
+         << "\n";
+  if (Batched == Called) return Error::success();
+
+  return make_error<StringError>(
+      "-batch-run: batched and called results differ",
+      inconvertibleErrorCode());
 }
 
 static void Driver() {
@@ -703,41 +2983,455 @@ static void Driver() {
   }
 }
 
+static cl::opt<std::string> CacheDir(
+    "cache-dir", cl::value_desc("directory"),
+    cl::desc("Reuse object files of compiled modules across runs"));
+
+// Keeps the object file of every module the JIT compiles, keyed by a hash of
+// the module's IR and the optimization level, so a module that has not
+// changed since an earlier run is loaded instead of compiled.
+class Toy_Object_Cache : public ObjectCache {
+  std::string Directory;
+  std::mutex Pending_Mutex;
+  DenseMap<const Module *, SmallString<128>> Pending_Paths;
+
+ public:
+  Toy_Object_Cache(StringRef Directory) : Directory(Directory) {}
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    SmallString<128> Path;
+    {
+      std::lock_guard<std::mutex> Lock(Pending_Mutex);
+      auto It = Pending_Paths.find(M);
+      if (It == Pending_Paths.end()) return;
+      Path = std::move(It->second);
+      Pending_Paths.erase(It);
+    }
+
+    // Write under a unique name and rename it into place, so concurrent runs
+    // never see a partially written object. The cache is best effort: an
+    // object that could not be written in full, say on a full disk, is
+    // dropped.
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath)) return;
+    bool Failed;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+      OS.close();
+      Failed = OS.has_error();
+      OS.clear_error();
+    }
+    if (Failed || sys::fs::rename(TempPath, Path)) sys::fs::remove(TempPath);
+  }
+
+  // Called before the module is compiled. Code generation rewrites the IR,
+  // so the path is computed here and kept for notifyObjectCompiled.
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    SmallString<128> Path = object_path(*M);
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Obj = MemoryBuffer::getFile(
+        Path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (Obj) return std::move(*Obj);
+
+    std::lock_guard<std::mutex> Lock(Pending_Mutex);
+    Pending_Paths[M] = std::move(Path);
+    return nullptr;
+  }
+
+ private:
+  // The module identifier is left out of the key: the JIT renames the
+  // modules it splits off, and the name does not change the code.
+  SmallString<128> object_path(const Module &M) {
+    std::string Key;
+    raw_string_ostream OS(Key);
+    OS << LLVM_VERSION_STRING << " -O" << OptLevel << " "
+       << M.getTargetTriple() << " " << M.getDataLayoutStr() << "\n";
+    for (const GlobalVariable &G : M.globals()) G.print(OS);
+    for (const Function &F : M) F.print(OS);
+
+    MD5 Hash;
+    Hash.update(Key);
+    MD5::MD5Result Result;
+    Hash.final(Result);
+
+    SmallString<128> Path(Directory);
+    sys::path::append(Path, Result.digest() + ".o");
+    return Path;
+  }
+};
+
+// Shared by the JITs of all sessions.
+static std::unique_ptr<Toy_Object_Cache> Object_Cache;
+static std::once_flag Object_Cache_Once;
+
+// The compiler the JIT uses for every module. It asks -cache-dir itself,
+// rather than through the base class, so lookups and loads are timed as the
+// cache phase and only code generation as the jit phase.
+class Toy_JIT_Compiler : public orc::TMOwningSimpleCompiler {
+  Toy_Object_Cache *Cache;
+
+ public:
+  Toy_JIT_Compiler(std::unique_ptr<TargetMachine> TM, Toy_Object_Cache *Cache)
+      : TMOwningSimpleCompiler(std::move(TM)), Cache(Cache) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    if (Cache) {
+      Phase_Timer Timer(PHASE_CACHE);
+      if (std::unique_ptr<MemoryBuffer> Obj = Cache->getObject(&M)) {
+        record_cached_object(M);
+        return std::move(Obj);
+      }
+    }
+
+    auto Obj = compile(M);
+    if (!Obj) return Obj;
+    record_object(M, (*Obj)->getMemBufferRef());
+    if (Cache) {
+      Phase_Timer Timer(PHASE_CACHE);
+      Cache->notifyObjectCompiled(&M, (*Obj)->getMemBufferRef());
+    }
+    return Obj;
+  }
+
+ private:
+  Expected<std::unique_ptr<MemoryBuffer>> compile(Module &M) {
+    Phase_Timer Timer(PHASE_JIT);
+    return TMOwningSimpleCompiler::operator()(M);
+  }
+};
+
+// Makes the -memoize runtime of this executable callable from JIT'd code.
+static Error define_memo_runtime(orc::LLLazyJIT &JIT) {
+  orc::SymbolMap Runtime;
+  JITSymbolFlags Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+  Runtime[JIT.mangleAndIntern("toy_memo_lookup")] = {
+      orc::ExecutorAddr::fromPtr(&toy_memo_lookup), Flags};
+  Runtime[JIT.mangleAndIntern("toy_memo_store")] = {
+      orc::ExecutorAddr::fromPtr(&toy_memo_store), Flags};
+  return JIT.getMainJITDylib().define(
+      orc::absoluteSymbols(std::move(Runtime)));
+}
+
+static Expected<std::unique_ptr<orc::LLLazyJIT>> create_jit() {
+  orc::LLLazyJITBuilder JITBuilder;
+
+  if (!CacheDir.empty()) {
+    if (std::error_code EC = sys::fs::create_directories(CacheDir))
+      return errorCodeToError(EC);
+    std::call_once(Object_Cache_Once, [] {
+      Object_Cache = std::make_unique<Toy_Object_Cache>(CacheDir);
+    });
+  }
+
+  JITBuilder.setCompileFunctionCreator(
+      [](orc::JITTargetMachineBuilder JTMB)
+          -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+        auto TM = JTMB.createTargetMachine();
+        if (!TM) return TM.takeError();
+        return std::make_unique<Toy_JIT_Compiler>(std::move(*TM),
+                                                  Object_Cache.get());
+      });
+
+  auto JIT = JITBuilder.create();
+  if (!JIT) return JIT.takeError();
+  if (Memoize)
+    if (Error Err = define_memo_runtime(**JIT)) return std::move(Err);
+  return std::move(*JIT);
+}
+
+// Objects are built for the default triple and a generic CPU, so they can
+// be linked into programs that run on other machines of the same kind.
+static std::unique_ptr<TargetMachine> create_object_target_machine() {
+  std::string Triple = sys::getDefaultTargetTriple();
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(Triple, Error);
+  if (!TheTarget) {
+    errs() << Error << "\n";
+    exit(1);
+  }
+
+  return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+      Triple, "generic", "", TargetOptions(), Reloc::PIC_));
+}
+
+static bool emit_object_file(Module &M) {
+  if (verifyModule(M, &errs())) return false;
+
+  SmallString<128> Path(OutputFilename);
+  if (Path.empty()) {
+    Path = InputFilename;
+    sys::path::replace_extension(Path, "o");
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    errs() << "Unable to open " << Path << ": " << EC.message() << "\n";
+    return false;
+  }
+
+  // The object is built in memory first so -stats can measure its code.
+  SmallVector<char, 0> Obj;
+  raw_svector_ostream ObjOS(Obj);
+  legacy::PassManager CodegenPM;
+  if (Opt_TM->addPassesToEmitFile(CodegenPM, ObjOS, nullptr,
+                                  CodeGenFileType::ObjectFile)) {
+    errs() << "The target cannot emit object files\n";
+    return false;
+  }
+  {
+    Phase_Timer Timer(PHASE_EMIT);
+    CodegenPM.run(M);
+  }
+
+  record_object(M, MemoryBufferRef(StringRef(Obj.data(), Obj.size()), Path));
+  OS << ObjOS.str();
+  return true;
+}
+
 static void init_operator_precedence() {
-  Operator_Precedence['<'] = 10;
-  Operator_Precedence['-'] = 20;
-  Operator_Precedence['+'] = 30;
-  Operator_Precedence['/'] = 40;
-  Operator_Precedence['*'] = 50;
+  Session->Operator_Precedence['<'] = 10;
+  Session->Operator_Precedence['-'] = 20;
+  Session->Operator_Precedence['+'] = 30;
+  Session->Operator_Precedence['/'] = 40;
+  Session->Operator_Precedence['*'] = 50;
 }
 
+// =======================
+// Library Interface
+// =======================
+
+// Sets up the current session: its JIT, or the target machine of -c, and
+// the built-in operators.
+static Error start_session() {
+  // Definitions written to an object file share one module, so they are
+  // generated in order on this thread. The pass pipeline then runs for the
+  // same target machine as the code generator.
+  if (EmitObject) {
+    Opt_TM = create_object_target_machine();
+  } else {
+    auto JIT = create_jit();
+    if (!JIT) return JIT.takeError();
+    Session->JIT = std::move(*JIT);
+  }
+  init_operator_precedence();
+
+  if (Codegen_Threads > 1 && !EmitObject)
+    Session->Codegen_Pool = std::make_unique<DefaultThreadPool>(
+        hardware_concurrency(Codegen_Threads));
+  return Error::success();
+}
+
+// Compiles Program into the current session and runs its top-level
+// expressions.
+static void compile_program(std::unique_ptr<MemoryBuffer> Program) {
+  ++Session->Generation;
+  Session->Recompiled.clear();
+  Source = std::move(Program);
+  Cur_Ptr = Source->getBufferStart();
+  InitializeModule();
+
+  next_token();
+  Driver();
+
+  if (Session->Whole_Program) remove_missing_definitions();
+  if (Session->Codegen_Pool) Session->Codegen_Pool->wait();
+}
+
+Toy_Compiler::Toy_Compiler() : State(std::make_unique<Toy_Session>()) {}
+
+Toy_Compiler::~Toy_Compiler() = default;
+
+Expected<std::unique_ptr<Toy_Compiler>> Toy_Compiler::create() {
+  static std::once_flag Native_Target;
+  std::call_once(Native_Target, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  });
+
+  std::unique_ptr<Toy_Compiler> Compiler(new Toy_Compiler());
+  Compiler->State->Incremental = !Tiered && !EmitObject;
+  Session_Scope Scope(*Compiler->State);
+  if (Error Err = start_session()) return std::move(Err);
+  return std::move(Compiler);
+}
+
+Expected<std::vector<int>> Toy_Compiler::run(StringRef Program,
+                                             StringRef Name) {
+  Session_Scope Scope(*State);
+  State->Results.clear();
+  compile_program(MemoryBuffer::getMemBufferCopy(Program, Name));
+  if (Error Err = take_errors(true)) return std::move(Err);
+  return State->Results;
+}
+
+Expected<orc::ExecutorAddr> Toy_Compiler::lookup_address(StringRef Name) {
+  return State->JIT->lookup(Name);
+}
+
+// Runs the program in -sessions compilers at once and prints the results
+// of the first, if they all agree.
+static bool run_sessions(StringRef Program) {
+  std::vector<std::vector<int>> Results(Sessions);
+  std::vector<std::thread> Threads;
+  std::atomic<bool> Failed(false);
+  for (unsigned I = 0; I < Sessions; ++I)
+    Threads.emplace_back([&, I] {
+      auto Compiler = Toy_Compiler::create();
+      if (!Compiler) {
+        logAllUnhandledErrors(Compiler.takeError(), errs(), "toy: ");
+        Failed = true;
+        return;
+      }
+      auto Result = (*Compiler)->run(Program, InputFilename);
+      if (!Result) {
+        std::lock_guard<std::mutex> Lock(Output_Mutex);
+        logAllUnhandledErrors(Result.takeError(), errs(), "toy: ");
+        Failed = true;
+        return;
+      }
+      Results[I] = std::move(*Result);
+    });
+  for (std::thread &T : Threads) T.join();
+  if (Failed) return false;
+
+  for (unsigned I = 1; I < Sessions; ++I)
+    if (Results[I] != Results[0]) {
+      std::cerr << "session " << I << " disagrees with session 0"
+                << std::endl;
+      return false;
+    }
+  for (int Result : Results[0]) outs() << "Evaluated to " << Result << "\n";
+  return true;
+}
+
+// Compiles the input again every time its modification time changes, until
+// the process is killed.
+static void watch_input() {
+  outs().flush();
+  sys::fs::file_status Status;
+  sys::fs::status(InputFilename, Status);
+  sys::TimePoint<> Last_Modified = Status.getLastModificationTime();
+
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (sys::fs::status(InputFilename, Status) ||
+        Status.getLastModificationTime() == Last_Modified)
+      continue;
+    Last_Modified = Status.getLastModificationTime();
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
+        MemoryBuffer::getFile(InputFilename);
+    if (!FileOrErr) continue;
+    compile_program(std::move(*FileOrErr));
+    logAllUnhandledErrors(take_errors(false), errs());
+
+    unsigned Defined = 0;
+    for (const auto &Entry : Session->Definitions)
+      Defined += Entry.second.Generation == Session->Generation;
+    outs() << "Recompiled " << Session->Recompiled.size() << " of " << Defined
+           << " definitions\n";
+    outs().flush();
+  }
+}
+
+// libtoy.a is built with TOY_LIBRARY defined and leaves main to the host.
+#ifndef TOY_LIBRARY
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <input-file>" << std::endl;
+  auto Start_Time = std::chrono::steady_clock::now();
+  cl::ParseCommandLineOptions(argc, argv, "toy compiler\n");
+
+  if (OptLevel > 3) {
+    std::cerr << "-O" << OptLevel << " is not an optimization level; use -O0 "
+              << "to -O3" << std::endl;
     return 1;
   }
 
-  file = fopen(argv[1], "r");
-  if (!file) {
-    std::cerr << "Unable to open file: " << argv[1] << std::endl;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
+      MemoryBuffer::getFile(InputFilename);
+  if (!FileOrErr) {
+    std::cerr << "Unable to open file: " << InputFilename << std::endl;
     return 1;
   }
 
   // Initialize LLVM
-  LLVMContext &Context = TheContext;
-  std::unique_ptr<Module> Mod =
-      std::make_unique<Module>("toy compiler", Context);
-  TheModule = Mod.get();
-  init_operator_precedence();
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
 
-  TheExecutionEngine = EngineBuilder(std::move(Mod)).create();
+  if (!BatchRun.empty() && EmitObject) {
+    std::cerr << "-batch-run needs the JIT and cannot be used with -c"
+              << std::endl;
+    return 1;
+  }
 
-  // Run the main parser loop
-  next_token();
-  Driver();
+  if (EmitObject && Memoize) {
+    std::cerr << "-memoize needs the JIT's runtime and cannot be used with -c"
+              << std::endl;
+    return 1;
+  }
 
-  TheModule->print(outs(), nullptr);
+  if (Watch && (EmitObject || Tiered || Sessions > 1 || !BatchRun.empty())) {
+    std::cerr << "-watch cannot be used with -c, -tiered, -sessions or "
+                 "-batch-run"
+              << std::endl;
+    return 1;
+  }
 
-  fclose(file);
+  // Plugin code, like the block-counter runtime, is found by the JIT through
+  // the process symbols that LLJIT links into every JITDylib.
+  for (const std::string &Path : PassPlugins) {
+    Expected<PassPlugin> Plugin = PassPlugin::Load(Path);
+    if (!Plugin) {
+      errs() << toString(Plugin.takeError()) << "\n";
+      return 1;
+    }
+    Pass_Plugins.push_back(*Plugin);
+  }
+
+  if (Sessions > 1) {
+    if (EmitObject || !BatchRun.empty()) {
+      std::cerr << "-sessions cannot be used with -c or -batch-run"
+                << std::endl;
+      return 1;
+    }
+    return run_sessions((*FileOrErr)->getBuffer()) ? 0 : 1;
+  }
+
+  Toy_Session CLI;
+  CLI.Print_IR = PrintIR;
+  CLI.Print_Results = true;
+  CLI.Incremental = Watch;
+  CLI.Whole_Program = Watch;
+  Session_Scope Scope(CLI);
+  ExitOnErr(start_session());
+
+  compile_program(std::move(*FileOrErr));
+  if (Error Err = take_errors(false)) {
+    logAllUnhandledErrors(std::move(Err), errs());
+    if (!Watch) return 1;
+  }
+  if (Watch) watch_input();
+
+  if (!BatchRun.empty()) {
+    Error Err = joinErrors(run_batch(BatchRun), take_errors(false));
+    if (Err) {
+      logAllUnhandledErrors(std::move(Err), errs());
+      return 1;
+    }
+  }
+  if (TimePassesIsEnabled && OptLevel > 0) print_pass_times();
+
+  if (EmitObject) {
+    run_plugin_passes(*TheModule);
+    if (!emit_object_file(*TheModule)) return 1;
+  }
+
+  if (TimeReport || AreStatisticsEnabled()) {
+    std::chrono::duration<double> Wall_Time =
+        std::chrono::steady_clock::now() - Start_Time;
+    print_report(*CreateInfoOutputFile(), Wall_Time.count());
+  }
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef TOY_COMPILER_H
+#define TOY_COMPILER_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ExecutionEngine/Orc/Shared/ExecutorAddress.h>
+#include <llvm/Support/Error.h>
+
+#include <memory>
+#include <vector>
+
+struct Toy_Session;
+
+// A compiler for programs that embed the toy. Every instance has its own
+// JIT, operators and definitions, so instances can run on different threads
+// at once; one instance is used by one thread at a time. The command line
+// options still apply to all of them. Hosts link libtoy.a, see the Makefile.
+class Toy_Compiler {
+  std::unique_ptr<Toy_Session> State;
+
+  Toy_Compiler();
+  llvm::Expected<llvm::orc::ExecutorAddr> lookup_address(llvm::StringRef Name);
+
+ public:
+  ~Toy_Compiler();
+
+  // Also initializes the native target, the first time.
+  static llvm::Expected<std::unique_ptr<Toy_Compiler>> create();
+
+  // Compiles the definitions in Program and returns the values of its
+  // top-level expressions. Later programs can call the definitions, and
+  // only compile those of their own definitions that changed. Fails if a
+  // definition or expression did not compile or the JIT reported an error;
+  // the definitions that did compile stay usable.
+  llvm::Expected<std::vector<int>> run(llvm::StringRef Program,
+                                       llvm::StringRef Name = "<program>");
+
+  // Finds a compiled definition, or its ".batch" form under -batch.
+  template <typename Fn>
+  llvm::Expected<Fn *> lookup(llvm::StringRef Name) {
+    llvm::Expected<llvm::orc::ExecutorAddr> Addr = lookup_address(Name);
+    if (!Addr) return Addr.takeError();
+    return Addr->toPtr<Fn *>();
+  }
+};
+
+#endif
@@ -0,0 +1,88 @@
+// Runs two Toy_Compilers on two threads at once. Each defines its own f, so
+// they only pass if their definitions stay apart. Then checks that callers
+// from earlier programs follow a definition that changes.
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "toy_compiler.h"
+
+static bool check(bool Ok, const std::string &What) {
+  if (!Ok) std::fprintf(stderr, "FAIL: %s\n", What.c_str());
+  return Ok;
+}
+
+static bool check_run(Toy_Compiler &Compiler, const char *Program,
+                      std::vector<int> Expected) {
+  llvm::Expected<std::vector<int>> Results = Compiler.run(Program);
+  if (!Results)
+    return check(false, std::string(Program) + ": " +
+                            llvm::toString(Results.takeError()));
+  return check(*Results == Expected, std::string(Program) + ": results");
+}
+
+// Tenant N defines f(x) as x + N and calls it through g from a later run.
+static bool run_tenant(int N) {
+  auto Compiler = Toy_Compiler::create();
+  if (!Compiler)
+    return check(false, "create: " + llvm::toString(Compiler.takeError()));
+  Toy_Compiler &C = **Compiler;
+
+  std::string Define_F = "def f(x) x + " + std::to_string(N) + ";";
+  bool Ok = check_run(C, Define_F.c_str(), {});
+  Ok &= check_run(C, "def g(x) f(x) * 2; g(1);", {2 * (1 + N)});
+
+  auto F = C.lookup<int(int)>("f");
+  if (!F) return check(false, "lookup f: " + llvm::toString(F.takeError()));
+  Ok &= check((*F)(10) == 10 + N, "f(10)");
+
+  auto Missing = C.lookup<int(int)>("missing");
+  Ok &= check(!Missing, "lookup of an undefined name fails");
+  if (!Missing) llvm::consumeError(Missing.takeError());
+
+  llvm::Expected<std::vector<int>> Bad = C.run("def h(x) x +;");
+  Ok &= check(!Bad, "a definition that does not parse fails run()");
+  if (!Bad) llvm::consumeError(Bad.takeError());
+  return Ok;
+}
+
+static bool check_redefinitions() {
+  auto Compiler = Toy_Compiler::create();
+  if (!Compiler)
+    return check(false, "create: " + llvm::toString(Compiler.takeError()));
+  Toy_Compiler &C = **Compiler;
+
+  // g from the second program has to call the new f, not the removed one.
+  bool Ok = check_run(C, "def f(x) x+1;", {});
+  Ok &= check_run(C, "def g(x) f(x); g(1);", {2});
+  Ok &= check_run(C, "def f(x) x+2; g(1);", {3});
+
+  // The old g no longer compiles once f takes two arguments, but the
+  // program replaces it too, so that is no failure.
+  auto Other = Toy_Compiler::create();
+  if (!Other)
+    return check(false, "create: " + llvm::toString(Other.takeError()));
+  Toy_Compiler &D = **Other;
+  Ok &= check_run(D, "def f(x) x; def g(x) f(x);", {});
+  Ok &= check_run(D, "def f(x y) x+y; def g(x) f(x, 1); g(2);", {3});
+
+  // Here nothing replaces g, which now calls f with the wrong arity.
+  llvm::Expected<std::vector<int>> Broken = D.run("def f(x y z) x;");
+  Ok &= check(!Broken, "a caller broken by a redefinition fails run()");
+  if (!Broken) llvm::consumeError(Broken.takeError());
+  return Ok;
+}
+
+int main() {
+  bool Ok[2];
+  std::thread Tenants[2];
+  for (int I = 0; I < 2; ++I)
+    Tenants[I] = std::thread([&Ok, I] { Ok[I] = run_tenant(I + 1); });
+  for (std::thread &T : Tenants) T.join();
+
+  if (!Ok[0] || !Ok[1] || !check_redefinitions()) return 1;
+  std::printf("toy_compiler_test passed\n");
+  return 0;
+}
@@ -0,0 +1,148 @@
+#include <map>
+#include <vector>
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+// Counts how often every basic block runs. Each function asks the runtime in
+// block_counter_rt.c for its thread's counters on entry, and each block then
+// increments its own counter with a plain load and store. The module also
+// gets a descriptor of its blocks and their opcodes, from which the runtime
+// reports the hottest blocks and the executed instructions by opcode.
+class BlockCounterPass : public PassInfoMixin<BlockCounterPass> {
+ public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    LLVMContext &Ctx = M.getContext();
+    Type *Int32 = Type::getInt32Ty(Ctx);
+    Type *Int64 = Type::getInt64Ty(Ctx);
+    PointerType *Ptr = PointerType::getUnqual(Ctx);
+
+    // Layouts of struct bc_block, bc_op and bc_module_info.
+    StructType *BlockTy = StructType::get(Ptr, Int32, Int32, Int32);
+    StructType *OpTy = StructType::get(Int32, Int32);
+    StructType *InfoTy = StructType::get(Int32, Int32, Int32, Int32, Ptr, Ptr,
+                                         Ptr, Ptr);
+
+    // Described before any counter code is added.
+    std::vector<Constant *> Blocks, Ops, Opcode_Names;
+    std::map<unsigned, unsigned> Opcode_Index;
+    std::vector<std::pair<Function *, std::vector<BasicBlock *>>> Functions;
+    for (Function &F : M) {
+      if (F.isDeclaration()) continue;
+      Constant *Name = makeString(M, F.getName(), "bc.function");
+      std::vector<BasicBlock *> Counted;
+      unsigned Index = 0;
+      for (BasicBlock &BB : F) {
+        // Blocks like catchswitch have no place for the increment.
+        if (BB.getFirstInsertionPt() == BB.end()) {
+          ++Index;
+          continue;
+        }
+
+        std::map<unsigned, unsigned> Counts;
+        for (Instruction &I : BB) ++Counts[I.getOpcode()];
+        unsigned First_Op = Ops.size();
+        for (auto [Opcode, Count] : Counts) {
+          auto [It, Inserted] =
+              Opcode_Index.try_emplace(Opcode, Opcode_Names.size());
+          if (Inserted)
+            Opcode_Names.push_back(makeString(
+                M, Instruction::getOpcodeName(Opcode), "bc.opcode"));
+          Ops.push_back(ConstantStruct::get(
+              OpTy, {ConstantInt::get(Int32, It->second),
+                     ConstantInt::get(Int32, Count)}));
+        }
+
+        Blocks.push_back(ConstantStruct::get(
+            BlockTy, {Name, ConstantInt::get(Int32, Index++),
+                      ConstantInt::get(Int32, First_Op),
+                      ConstantInt::get(Int32, Ops.size() - First_Op)}));
+        Counted.push_back(&BB);
+      }
+      Functions.push_back({&F, std::move(Counted)});
+    }
+    if (Blocks.empty()) return PreservedAnalyses::all();
+
+    GlobalVariable *Info = new GlobalVariable(
+        M, InfoTy, false, GlobalValue::PrivateLinkage,
+        ConstantStruct::get(
+            InfoTy, {ConstantInt::get(Int32, -1),
+                     ConstantInt::get(Int32, Blocks.size()),
+                     ConstantInt::get(Int32, Ops.size()),
+                     ConstantInt::get(Int32, Opcode_Names.size()),
+                     makeString(M, M.getModuleIdentifier(), "bc.module"),
+                     makeArray(M, BlockTy, Blocks, "bc.blocks"),
+                     makeArray(M, OpTy, Ops, "bc.ops"),
+                     makeArray(M, Ptr, Opcode_Names, "bc.opcode_names")}),
+        "bc.module_info");
+
+    FunctionCallee Get_Buffer = M.getOrInsertFunction(
+        "__block_counter_buffer", FunctionType::get(Ptr, {Ptr}, false));
+
+    unsigned Counter = 0;
+    for (auto &[F, Counted] : Functions) {
+      if (Counted.empty()) continue;
+
+      // After the allocas, which later passes expect at the top.
+      BasicBlock &Entry = F->getEntryBlock();
+      BasicBlock::iterator IP = Entry.getFirstInsertionPt();
+      while (isa<AllocaInst>(IP)) ++IP;
+      IRBuilder<> Builder(&Entry, IP);
+      Value *Buffer = Builder.CreateCall(Get_Buffer, {Info}, "bc.buffer");
+
+      for (BasicBlock *BB : Counted) {
+        if (BB != &Entry) Builder.SetInsertPoint(BB, BB->getFirstInsertionPt());
+        Value *Slot = Builder.CreateConstInBoundsGEP1_32(Int64, Buffer,
+                                                         Counter++);
+        Value *Count = Builder.CreateLoad(Int64, Slot, "bc.count");
+        Builder.CreateStore(
+            Builder.CreateAdd(Count, ConstantInt::get(Int64, 1)), Slot);
+      }
+    }
+
+    return PreservedAnalyses::none();
+  }
+  static bool isRequired() { return true; }
+
+ private:
+  static Constant *makeString(Module &M, StringRef S, const Twine &Name) {
+    Constant *Data =
+        ConstantDataArray::getString(M.getContext(), S, /*AddNull=*/true);
+    auto *GV = new GlobalVariable(M, Data->getType(), true,
+                                  GlobalValue::PrivateLinkage, Data, Name);
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return GV;
+  }
+
+  static Constant *makeArray(Module &M, Type *ElementTy,
+                             ArrayRef<Constant *> Elements,
+                             const Twine &Name) {
+    ArrayType *Ty = ArrayType::get(ElementTy, Elements.size());
+    return new GlobalVariable(M, Ty, true, GlobalValue::PrivateLinkage,
+                              ConstantArray::get(Ty, Elements), Name);
+  }
+};
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "BlockCounter", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "block-counter") {
+                    MPM.addPass(BlockCounterPass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
@@ -0,0 +1,248 @@
+// Runtime of the block-counter pass. Instrumented code asks for its thread's
+// counters once per call and then increments them without atomics. A thread
+// adds its counters to the module totals when it exits, the main thread when
+// the process exits, and the totals are then written to stderr, or to the
+// file named by BLOCK_COUNTER_OUTPUT. BLOCK_COUNTER_TOP sets how many of the
+// hottest blocks are listed (default 20).
+//
+// Threads still running at exit are not counted.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Written by block_counter.cpp; the layouts must match.
+struct bc_block {
+  const char *function;
+  uint32_t index;  // position of the block in its function
+  uint32_t first_op;
+  uint32_t num_ops;
+};
+
+struct bc_op {
+  uint32_t opcode;  // index into opcode_names
+  uint32_t count;
+};
+
+struct bc_module_info {
+  int32_t id;  // -1 until the module is registered
+  uint32_t num_blocks;
+  uint32_t num_ops;
+  uint32_t num_opcodes;
+  const char *name;
+  const struct bc_block *blocks;
+  const struct bc_op *ops;
+  const char *const *opcode_names;
+};
+
+// The descriptor is copied when the module registers, so the report does not
+// depend on code that may be gone by exit, like a JIT's.
+struct bc_module {
+  struct bc_module_info info;
+  uint64_t *totals;
+};
+
+struct bc_thread {
+  int32_t capacity;
+  uint64_t **buffers;  // indexed by module id
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static struct bc_module **modules;
+static int32_t num_modules;
+static __thread struct bc_thread *current;
+
+static char *copy_string(const char *s) {
+  size_t n = strlen(s) + 1;
+  return (char *)memcpy(malloc(n), s, n);
+}
+
+static void *copy_array(const void *p, size_t n) {
+  return n ? memcpy(malloc(n), p, n) : NULL;
+}
+
+// Adds the thread's counters to the totals. Called with the lock held.
+static void flush_thread(struct bc_thread *t) {
+  for (int32_t id = 0; id < t->capacity; ++id) {
+    uint64_t *buffer = t->buffers[id];
+    if (!buffer) continue;
+    struct bc_module *m = modules[id];
+    for (uint32_t b = 0; b < m->info.num_blocks; ++b)
+      m->totals[b] += buffer[b];
+    free(buffer);
+  }
+  free(t->buffers);
+  free(t);
+}
+
+// Runs on the exiting thread, whose later destructors may still count blocks.
+static void thread_exit(void *t) {
+  pthread_mutex_lock(&lock);
+  flush_thread((struct bc_thread *)t);
+  current = NULL;
+  pthread_mutex_unlock(&lock);
+}
+
+static const uint64_t *sort_keys;
+
+static int by_count(const void *a, const void *b) {
+  uint64_t x = sort_keys[*(const uint32_t *)a];
+  uint64_t y = sort_keys[*(const uint32_t *)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static uint32_t *sorted_indices(const uint64_t *keys, uint32_t n) {
+  uint32_t *order = (uint32_t *)malloc(n * sizeof(uint32_t));
+  for (uint32_t i = 0; i < n; ++i) order[i] = i;
+  sort_keys = keys;
+  qsort(order, n, sizeof(uint32_t), by_count);
+  return order;
+}
+
+static void report_module(FILE *out, const struct bc_module *m,
+                          uint32_t top) {
+  const struct bc_module_info *info = &m->info;
+  uint64_t executed = 0;
+  uint64_t *opcodes = (uint64_t *)calloc(info->num_opcodes, sizeof(uint64_t));
+  for (uint32_t b = 0; b < info->num_blocks; ++b) {
+    const struct bc_block *block = &info->blocks[b];
+    executed += m->totals[b];
+    for (uint32_t i = 0; i < block->num_ops; ++i) {
+      const struct bc_op *op = &info->ops[block->first_op + i];
+      opcodes[op->opcode] += m->totals[b] * op->count;
+    }
+  }
+
+  // Modules that never ran, like JIT'd definitions that were not called.
+  if (!executed) {
+    free(opcodes);
+    return;
+  }
+
+  fprintf(out, "Module %s: %llu block executions\n", info->name,
+          (unsigned long long)executed);
+  fprintf(out, "Hottest blocks:\n");
+  uint32_t *order = sorted_indices(m->totals, info->num_blocks);
+  for (uint32_t i = 0; i < info->num_blocks && i < top; ++i) {
+    const struct bc_block *block = &info->blocks[order[i]];
+    if (!m->totals[order[i]]) break;
+    fprintf(out, "%14llu  %s block %u\n",
+            (unsigned long long)m->totals[order[i]], block->function,
+            block->index);
+  }
+  free(order);
+
+  fprintf(out, "Executed instructions by opcode:\n");
+  order = sorted_indices(opcodes, info->num_opcodes);
+  for (uint32_t i = 0; i < info->num_opcodes; ++i) {
+    if (!opcodes[order[i]]) break;
+    fprintf(out, "%14llu  %s\n", (unsigned long long)opcodes[order[i]],
+            info->opcode_names[order[i]]);
+  }
+  free(order);
+  free(opcodes);
+}
+
+// BLOCK_COUNTER_TOP, or the default if it is unset or not a count.
+static uint32_t top_blocks(void) {
+  const char *top = getenv("BLOCK_COUNTER_TOP");
+  if (!top) return 20;
+
+  char *end;
+  errno = 0;
+  long n = strtol(top, &end, 10);
+  if (errno || end == top || *end || n < 0 || n > UINT32_MAX) {
+    fprintf(stderr, "block counter: ignoring BLOCK_COUNTER_TOP=%s\n", top);
+    return 20;
+  }
+  return (uint32_t)n;
+}
+
+static void process_exit(void) {
+  pthread_mutex_lock(&lock);
+  if (current) flush_thread(current);
+  current = NULL;
+
+  const char *path = getenv("BLOCK_COUNTER_OUTPUT");
+  uint32_t top = top_blocks();
+  FILE *out = path ? fopen(path, "w") : stderr;
+  if (out) {
+    for (int32_t id = 0; id < num_modules; ++id)
+      report_module(out, modules[id], top);
+    if (out != stderr) fclose(out);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void initialize(void) {
+  pthread_key_create(&thread_key, thread_exit);
+  atexit(process_exit);
+}
+
+// Called with the lock held.
+static int32_t register_module(struct bc_module_info *info) {
+  struct bc_module *m = (struct bc_module *)malloc(sizeof(struct bc_module));
+  m->info = *info;
+  m->info.name = copy_string(info->name);
+  m->info.ops = (const struct bc_op *)copy_array(
+      info->ops, info->num_ops * sizeof(struct bc_op));
+
+  struct bc_block *blocks = (struct bc_block *)copy_array(
+      info->blocks, info->num_blocks * sizeof(struct bc_block));
+  for (uint32_t b = 0; b < info->num_blocks; ++b)
+    blocks[b].function = copy_string(blocks[b].function);
+  m->info.blocks = blocks;
+
+  const char **names =
+      (const char **)malloc(info->num_opcodes * sizeof(char *));
+  for (uint32_t i = 0; i < info->num_opcodes; ++i)
+    names[i] = copy_string(info->opcode_names[i]);
+  m->info.opcode_names = names;
+
+  m->totals = (uint64_t *)calloc(info->num_blocks, sizeof(uint64_t));
+  modules = (struct bc_module **)realloc(
+      modules, (num_modules + 1) * sizeof(struct bc_module *));
+  modules[num_modules] = m;
+  return num_modules++;
+}
+
+static uint64_t *new_buffer(struct bc_module_info *info) {
+  pthread_once(&once, initialize);
+
+  pthread_mutex_lock(&lock);
+  int32_t id = info->id;
+  if (id < 0) {
+    id = register_module(info);
+    __atomic_store_n(&info->id, id, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&lock);
+
+  struct bc_thread *t = current;
+  if (!t) {
+    t = current = (struct bc_thread *)calloc(1, sizeof(struct bc_thread));
+    pthread_setspecific(thread_key, t);
+  }
+  if (id >= t->capacity) {
+    int32_t capacity = id + 8;
+    t->buffers =
+        (uint64_t **)realloc(t->buffers, capacity * sizeof(uint64_t *));
+    memset(t->buffers + t->capacity, 0,
+           (capacity - t->capacity) * sizeof(uint64_t *));
+    t->capacity = capacity;
+  }
+  t->buffers[id] = (uint64_t *)calloc(info->num_blocks, sizeof(uint64_t));
+  return t->buffers[id];
+}
+
+uint64_t *__block_counter_buffer(struct bc_module_info *info) {
+  int32_t id = __atomic_load_n(&info->id, __ATOMIC_ACQUIRE);
+  struct bc_thread *t = current;
+  if (id >= 0 && t && id < t->capacity && t->buffers[id])
+    return t->buffers[id];
+  return new_buffer(info);
+}
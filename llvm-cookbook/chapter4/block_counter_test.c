@@ -0,0 +1,22 @@
+#include <pthread.h>
+#include <stdio.h>
+
+// func comes from opcode_count_test.c, which is the instrumented part.
+int func(int a, int b);
+
+static void *worker(void *arg) {
+  int *result = (int *)arg;
+  *result = func(100, 50);
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[4];
+  int results[4];
+  for (int i = 0; i < 4; ++i)
+    pthread_create(&threads[i], NULL, worker, &results[i]);
+  for (int i = 0; i < 4; ++i) pthread_join(threads[i], NULL);
+
+  printf("%d %d\n", results[0], func(10, 10));
+  return 0;
+}
@@ -0,0 +1,129 @@
+#include <utility>
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+using namespace llvm;
+
+// Answers the cheap questions and leaves the rest to the next analysis of
+// the AA pipeline:
+//  - distinct allocas never alias;
+//  - accesses at constant offsets from the same pointer alias only if their
+//    bytes overlap, so the fields of a struct are told apart, unless the
+//    pointer may take a different value in another iteration of a cycle;
+//  - a local is not reached through arguments, nor through loads and call
+//    results unless its address was captured before them.
+class FieldSensitiveAAResult : public AAResultBase {
+ public:
+  explicit FieldSensitiveAAResult(const DataLayout &DL) : DL(DL) {}
+  FieldSensitiveAAResult(FieldSensitiveAAResult &&) = default;
+
+  AliasResult alias(const MemoryLocation &LocA, const MemoryLocation &LocB,
+                    AAQueryInfo &AAQI, const Instruction *CtxI) {
+    APInt OffsetA(DL.getIndexTypeSizeInBits(LocA.Ptr->getType()), 0);
+    APInt OffsetB(DL.getIndexTypeSizeInBits(LocB.Ptr->getType()), 0);
+    const Value *BaseA = LocA.Ptr->stripAndAccumulateConstantOffsets(
+        DL, OffsetA, /*AllowNonInbounds=*/true);
+    const Value *BaseB = LocB.Ptr->stripAndAccumulateConstantOffsets(
+        DL, OffsetB, /*AllowNonInbounds=*/true);
+
+    if (BaseA == BaseB && isSameValueInEveryIteration(BaseA, AAQI)) {
+      if (OffsetA == OffsetB) return AliasResult::MustAlias;
+      if (disjoint(OffsetA.getSExtValue(), LocA.Size, OffsetB.getSExtValue(),
+                   LocB.Size))
+        return AliasResult::NoAlias;
+    } else if (BaseA != BaseB) {
+      const Value *ObjectA = getUnderlyingObject(BaseA);
+      const Value *ObjectB = getUnderlyingObject(BaseB);
+      if (ObjectA != ObjectB &&
+          ((isa<AllocaInst>(ObjectA) && isa<AllocaInst>(ObjectB)) ||
+           isUnreachableLocal(ObjectA, ObjectB, AAQI) ||
+           isUnreachableLocal(ObjectB, ObjectA, AAQI)))
+        return AliasResult::NoAlias;
+    }
+
+    return AAResultBase::alias(LocA, LocB, AAQI, CtxI);
+  }
+
+  // Nothing about the IR is kept between queries.
+  bool invalidate(Function &, const PreservedAnalyses &,
+                  FunctionAnalysisManager::Invalidator &) {
+    return false;
+  }
+
+ private:
+  const DataLayout &DL;
+
+  // The access that starts first has to end before the other one starts.
+  // Both sizes must be known: an access of unknown size may also reach
+  // before its pointer.
+  static bool disjoint(int64_t OffsetA, LocationSize SizeA, int64_t OffsetB,
+                       LocationSize SizeB) {
+    if (!SizeA.hasValue() || SizeA.isScalable() || !SizeB.hasValue() ||
+        SizeB.isScalable())
+      return false;
+    if (OffsetA > OffsetB) {
+      std::swap(OffsetA, OffsetB);
+      std::swap(SizeA, SizeB);
+    }
+    return uint64_t(OffsetB - OffsetA) >= SizeA.getValue().getFixedValue();
+  }
+
+  // Queries across iterations compare a value with itself from another
+  // iteration, which only values outside any cycle are sure to equal, like
+  // basic-aa's isValueEqualInPotentialCycles without the cycle search.
+  static bool isSameValueInEveryIteration(const Value *V, AAQueryInfo &AAQI) {
+    if (!AAQI.MayBeCrossIteration) return true;
+    const auto *I = dyn_cast<Instruction>(V);
+    return !I || I->getParent()->isEntryBlock();
+  }
+
+  // Whether Local is an alloca that Source, a pointer from outside the
+  // function, cannot reach. The capture query is cached in AAQI.
+  static bool isUnreachableLocal(const Value *Local, const Value *Source,
+                                 AAQueryInfo &AAQI) {
+    if (!isa<AllocaInst>(Local)) return false;
+    if (isa<Argument>(Source)) return true;
+    const auto *I = dyn_cast<Instruction>(Source);
+    return I && isEscapeSource(I) &&
+           AAQI.CA->isNotCapturedBefore(Local, I, /*OrAt=*/true);
+  }
+};
+
+class FieldSensitiveAA : public AnalysisInfoMixin<FieldSensitiveAA> {
+  friend AnalysisInfoMixin<FieldSensitiveAA>;
+  static AnalysisKey Key;
+
+ public:
+  using Result = FieldSensitiveAAResult;
+  Result run(Function &F, FunctionAnalysisManager &AM) {
+    return FieldSensitiveAAResult(F.getParent()->getDataLayout());
+  }
+};
+
+AnalysisKey FieldSensitiveAA::Key;
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "FieldSensitiveAA", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](FunctionAnalysisManager &FAM) {
+                  FAM.registerPass([] { return FieldSensitiveAA(); });
+                });
+            // Joins the chain with -aa-pipeline=field-sensitive-aa,basic-aa;
+            // the first analysis with a definite answer wins.
+            PB.registerParseAACallback([](StringRef Name, AAManager &AAM) {
+              if (Name != "field-sensitive-aa") return false;
+              AAM.registerFunctionAnalysis<FieldSensitiveAA>();
+              return true;
+            });
+          }};
+}
@@ -0,0 +1,52 @@
+struct particle {
+  int x, y, z;
+  int mass;
+};
+
+// The fields of one particle are told apart.
+int move(struct particle *p, int dx, int dy) {
+  p->x += dx;
+  p->y += dy;
+  p->z += p->mass;
+  return p->x + p->y + p->z;
+}
+
+// history never escapes, so the stores through out cannot change it.
+int smooth(int *out, const int *in, int n) {
+  int history[4] = {0, 0, 0, 0};
+  int sum = 0;
+  for (int i = 0; i < n; ++i) {
+    history[i & 3] = in[i];
+    out[i] = history[0] + history[1] + history[2] + history[3];
+    sum += history[i & 3];
+  }
+  return sum;
+}
+
+// Two local arrays never overlap.
+int copy_local(int n) {
+  int a[16], b[16];
+  for (int i = 0; i < 16; ++i) a[i] = i * n;
+  for (int i = 0; i < 16; ++i) b[i] = a[15 - i];
+  return b[0] + b[15];
+}
+
+// Eight member accesses deep, value is past the GEPs basic-aa decomposes,
+// so only field-sensitive-aa tells it from tag and LICM can hoist the load.
+struct level1 { int value, flags; };
+struct level2 { int tag; struct level1 inner; };
+struct level3 { int tag; struct level2 inner; };
+struct level4 { int tag; struct level3 inner; };
+struct level5 { int tag; struct level4 inner; };
+struct level6 { int tag; struct level5 inner; };
+struct level7 { int tag; struct level6 inner; };
+struct level8 { int tag; struct level7 inner; };
+
+int deep_field(struct level8 *p, int n) {
+  int sum = 0;
+  for (int i = 0; i < n; ++i) {
+    p->inner.inner.inner.inner.inner.inner.inner.value = i;
+    sum += p->tag;
+  }
+  return sum;
+}
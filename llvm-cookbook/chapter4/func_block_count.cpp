@@ -1,31 +1,146 @@
+#include <iterator>
+#include <vector>
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
 
+// Besides the blocks of every loop nest level, estimates how often each loop
+// runs and ranks the loops by the instructions they execute per call of the
+// function. Trip counts come from ScalarEvolution where it can compute them,
+// and BlockFrequencyInfo weighs the blocks inside a loop and stands in for
+// trip counts it cannot. Run it after mem2reg, since ScalarEvolution cannot
+// follow induction variables kept in memory, and after loop-rotate, so the
+// header of a loop runs once per iteration.
 class FunctionBlockCount : public PassInfoMixin<FunctionBlockCount> {
  public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
     LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
 
     errs() << "Function " << F.getName() + "\n";
 
-    for (Loop *L : LI) countBlocksInLoop(L, 0);
+    std::vector<LoopProfile> Profiles;
+    for (Loop *L : LI) countBlocksInLoop(L, 0, 0, LI, SE, BFI, Profiles);
+
+    printHottestLoops(Profiles);
 
     return PreservedAnalyses::all();
   }
 
  private:
-  void countBlocksInLoop(Loop *L, unsigned nest) {
+  struct LoopProfile {
+    Loop *L;
+    unsigned Nest;
+    unsigned TripCount;
+    // Times the header runs per call of the function.
+    double HeaderRuns;
+    // Instructions in the loop, and instructions it executes per call, both
+    // including its subloops.
+    unsigned Instructions;
+    double Executed;
+  };
+
+  static double relativeFrequency(BlockFrequencyInfo &BFI, BasicBlock *BB,
+                                  BasicBlock *Base) {
+    // Blocks BFI deems unreachable have frequency zero.
+    uint64_t BaseFreq = BFI.getBlockFreq(Base).getFrequency();
+    if (!BaseFreq) return 0;
+    return (double)BFI.getBlockFreq(BB).getFrequency() / BaseFreq;
+  }
+
+  // Times BB runs per call, where BB belongs to Parent, or to no loop if
+  // Parent is null.
+  static double runsPerCall(BlockFrequencyInfo &BFI, BasicBlock *BB,
+                            Loop *Parent, double ParentRuns) {
+    if (!Parent)
+      return (double)BFI.getBlockFreq(BB).getFrequency() /
+             BFI.getEntryFreq().getFrequency();
+    return ParentRuns * relativeFrequency(BFI, BB, Parent->getHeader());
+  }
+
+  // Returns the instructions the loop nest executes per call.
+  double countBlocksInLoop(Loop *L, unsigned nest, double ParentRuns,
+                           LoopInfo &LI, ScalarEvolution &SE,
+                           BlockFrequencyInfo &BFI,
+                           std::vector<LoopProfile> &Profiles) {
     unsigned num_Blocks = L->getBlocks().size();
+    BasicBlock *Header = L->getHeader();
+    Loop *Parent = L->getParentLoop();
+
+    // A known trip count replaces the guess that the branch probabilities
+    // make for the back edge.
+    unsigned TripCount = SE.getSmallConstantTripCount(L);
+    double HeaderRuns;
+    if (BasicBlock *Preheader = L->getLoopPreheader()) {
+      double PreheaderRuns = runsPerCall(BFI, Preheader, Parent, ParentRuns);
+      HeaderRuns =
+          TripCount ? PreheaderRuns * TripCount
+                    : PreheaderRuns * relativeFrequency(BFI, Header, Preheader);
+    } else {
+      HeaderRuns = runsPerCall(BFI, Header, Parent, ParentRuns);
+    }
+
+    unsigned Instructions = 0;
+    double Executed = 0;
+    for (BasicBlock *BB : L->getBlocks()) {
+      Instructions += BB->size();
+      if (LI.getLoopFor(BB) == L)
+        Executed +=
+            BB->size() * HeaderRuns * relativeFrequency(BFI, BB, Header);
+    }
+
+    errs() << "Loop level" << nest << " has " << num_Blocks << " blocks, "
+           << Instructions << " instructions, trip count ";
+    if (TripCount)
+      errs() << TripCount;
+    else
+      errs() << "unknown";
+    errs() << format(", header runs %.1f times per call\n", HeaderRuns);
+
+    size_t Index = Profiles.size();
+    Profiles.push_back({L, nest, TripCount, HeaderRuns, Instructions, 0});
+    for (Loop *SubLoop : L->getSubLoops())
+      Executed += countBlocksInLoop(SubLoop, nest + 1, HeaderRuns, LI, SE,
+                                    BFI, Profiles);
+    Profiles[Index].Executed = Executed;
+    return Executed;
+  }
+
+  // Only outermost loops are ranked: the count of a loop includes its
+  // subloops, so ranking those too would count them twice.
+  static void printHottestLoops(const std::vector<LoopProfile> &Profiles) {
+    std::vector<LoopProfile> Nests;
+    llvm::copy_if(Profiles, std::back_inserter(Nests),
+                  [](const LoopProfile &P) { return P.Nest == 0; });
+    if (Nests.empty()) return;
 
-    errs() << "Loop level" << nest << " has " << num_Blocks << " blocks\n";
+    llvm::stable_sort(Nests, [](const LoopProfile &A, const LoopProfile &B) {
+      return A.Executed > B.Executed;
+    });
 
-    for (Loop *SubLoop : L->getSubLoops()) countBlocksInLoop(SubLoop, nest + 1);
+    errs() << "Hottest loop nests, by instructions executed per call:\n";
+    unsigned Rank = 0;
+    for (const LoopProfile &P : Nests) {
+      errs() << format("%4u. %12.1f  loop nest at ", ++Rank, P.Executed);
+      if (DebugLoc Loc = P.L->getStartLoc())
+        errs() << "line " << Loc.getLine();
+      else
+        P.L->getHeader()->printAsOperand(errs(), false);
+      errs() << ", " << P.Instructions << " instructions";
+      if (P.TripCount) errs() << ", trip count " << P.TripCount;
+      errs() << "\n";
+    }
   }
 };
 
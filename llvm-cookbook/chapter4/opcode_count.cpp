@@ -1,42 +1,244 @@
-#include <map>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+#include "llvm/ADT/SmallString.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/JSON.h"
 #include "llvm/Support/raw_ostream.h"
 
 using namespace llvm;
 
-class OpcodeCountPass : public PassInfoMixin<OpcodeCountPass> {
- private:
-  std::map<std::string, int> opcodeCounter;
+// Indexed by Instruction::getOpcode(), so counting an instruction is one
+// increment instead of a name lookup.
+using OpcodeCounts = std::array<uint64_t, Instruction::OtherOpsEnd>;
+
+static uint64_t countOpcodes(const Function &F, OpcodeCounts &Counts) {
+  uint64_t Total = 0;
+  for (const BasicBlock &BB : F) {
+    for (const Instruction &I : BB) ++Counts[I.getOpcode()];
+    Total += BB.size();
+  }
+  return Total;
+}
+
+// The opcodes that occur, in the order of their names.
+static SmallVector<unsigned, 64> usedOpcodes(const OpcodeCounts &Counts) {
+  SmallVector<unsigned, 64> Opcodes;
+  for (unsigned Opcode = 0; Opcode != Counts.size(); ++Opcode)
+    if (Counts[Opcode]) Opcodes.push_back(Opcode);
+  llvm::sort(Opcodes, [](unsigned A, unsigned B) {
+    return std::strcmp(Instruction::getOpcodeName(A),
+                       Instruction::getOpcodeName(B)) < 0;
+  });
+  return Opcodes;
+}
 
+class OpcodeCountPass : public PassInfoMixin<OpcodeCountPass> {
  public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-    errs() << "Function " << F.getName() << "\n";
-
-    for (auto &BB : F) {
-      for (auto &I : BB) {
-        if (opcodeCounter.find(I.getOpcodeName()) == opcodeCounter.end())
-          opcodeCounter[I.getOpcodeName()] = 1;
-        else
-          opcodeCounter[I.getOpcodeName()] += 1;
+    OpcodeCounts Counts = {};
+    countOpcodes(F, Counts);
+
+    // stderr is unbuffered, so the report is written in one piece.
+    SmallString<256> Report;
+    raw_svector_ostream OS(Report);
+    OS << "Function " << F.getName() << "\n";
+    for (unsigned Opcode : usedOpcodes(Counts))
+      OS << Instruction::getOpcodeName(Opcode) << ": " << Counts[Opcode]
+         << "\n";
+    OS << "\n";
+    errs() << Report;
+
+    return PreservedAnalyses::all();
+  }
+  static bool isRequired() { return true; }
+};
+
+enum class ReportFormat { Text, CSV, JSON };
+
+// Counts the opcodes of a whole module, with the functions spread over
+// several threads, and reports them per function and for the module.
+// Text goes to stderr like opcode-count; CSV and JSON go to stdout.
+class ModuleOpcodeCountPass : public PassInfoMixin<ModuleOpcodeCountPass> {
+ private:
+  ReportFormat Format;
+  unsigned Threads;
+
+  struct FunctionCounts {
+    const Function *F;
+    uint64_t Total = 0;
+    OpcodeCounts Counts = {};
+  };
+
+  // Functions are handed out in chunks, so threads that got small ones
+  // take more. Each thread sums its own module totals and merges them once.
+  void countFunctions(std::vector<FunctionCounts> &Rows, OpcodeCounts &Counts,
+                      uint64_t &Total) {
+    const size_t Chunk = 16;
+    std::atomic<size_t> Next(0);
+    std::mutex Merge_Mutex;
+
+    auto Worker = [&] {
+      OpcodeCounts Thread_Counts = {};
+      uint64_t Thread_Total = 0;
+      for (size_t Begin; (Begin = Next.fetch_add(Chunk)) < Rows.size();) {
+        size_t End = std::min(Begin + Chunk, Rows.size());
+        for (size_t I = Begin; I != End; ++I) {
+          FunctionCounts &Row = Rows[I];
+          Row.Total = countOpcodes(*Row.F, Row.Counts);
+          for (unsigned Opcode = 0; Opcode != Counts.size(); ++Opcode)
+            Thread_Counts[Opcode] += Row.Counts[Opcode];
+          Thread_Total += Row.Total;
+        }
       }
-    }
 
-    for (const auto &[opcode, count] : opcodeCounter) {
-      errs() << opcode << ": " << count << "\n";
+      std::lock_guard<std::mutex> Lock(Merge_Mutex);
+      for (unsigned Opcode = 0; Opcode != Counts.size(); ++Opcode)
+        Counts[Opcode] += Thread_Counts[Opcode];
+      Total += Thread_Total;
+    };
+
+    unsigned Num_Threads =
+        Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+    Num_Threads =
+        std::min<size_t>(Num_Threads, (Rows.size() + Chunk - 1) / Chunk);
+
+    std::vector<std::thread> Workers;
+    for (unsigned I = 1; I < Num_Threads; ++I) Workers.emplace_back(Worker);
+    Worker();
+    for (std::thread &T : Workers) T.join();
+  }
+
+  static void printText(raw_ostream &OS, StringRef Name, uint64_t Total,
+                        const OpcodeCounts &Counts) {
+    OS << Name << ": " << Total << " instructions\n";
+    for (unsigned Opcode : usedOpcodes(Counts))
+      OS << "  " << Instruction::getOpcodeName(Opcode) << ": "
+         << Counts[Opcode] << "\n";
+  }
+
+  // Names may hold commas, quotes or newlines (a module identifier is a
+  // path), so they are quoted as in RFC 4180, with quotes doubled.
+  static std::string quoteCSV(StringRef Field) {
+    std::string Quoted = "\"";
+    for (char C : Field) {
+      if (C == '"') Quoted += '"';
+      Quoted += C;
     }
+    return Quoted + "\"";
+  }
+
+  // One row per opcode, plus a "total" row. Module rows have the scope
+  // "module" and the module identifier as their name.
+  static void printCSV(raw_ostream &OS, StringRef Scope, StringRef Name,
+                       uint64_t Total, const OpcodeCounts &Counts) {
+    std::string Field = quoteCSV(Name);
+    for (unsigned Opcode : usedOpcodes(Counts))
+      OS << Scope << "," << Field << "," << Instruction::getOpcodeName(Opcode)
+         << "," << Counts[Opcode] << "\n";
+    OS << Scope << "," << Field << ",total," << Total << "\n";
+  }
+
+  static void printJSON(json::OStream &J, uint64_t Total,
+                        const OpcodeCounts &Counts) {
+    J.attribute("instructions", Total);
+    J.attributeObject("opcodes", [&] {
+      for (unsigned Opcode : usedOpcodes(Counts))
+        J.attribute(Instruction::getOpcodeName(Opcode), Counts[Opcode]);
+    });
+  }
+
+ public:
+  ModuleOpcodeCountPass(ReportFormat Format, unsigned Threads)
+      : Format(Format), Threads(Threads) {}
+
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+    std::vector<FunctionCounts> Rows;
+    for (const Function &F : M)
+      if (!F.isDeclaration()) Rows.push_back({&F});
+
+    OpcodeCounts Counts = {};
+    uint64_t Total = 0;
+    countFunctions(Rows, Counts, Total);
 
-    errs() << "\n";
-    opcodeCounter.clear();
+    switch (Format) {
+      case ReportFormat::Text: {
+        std::string Report;
+        raw_string_ostream OS(Report);
+        for (const FunctionCounts &Row : Rows)
+          printText(OS, "Function " + Row.F->getName().str(), Row.Total,
+                    Row.Counts);
+        printText(OS, "Module " + M.getModuleIdentifier(), Total, Counts);
+        errs() << OS.str();
+        break;
+      }
+
+      case ReportFormat::CSV:
+        outs() << "scope,name,opcode,count\n";
+        for (const FunctionCounts &Row : Rows)
+          printCSV(outs(), "function", Row.F->getName(), Row.Total,
+                   Row.Counts);
+        printCSV(outs(), "module", M.getModuleIdentifier(), Total, Counts);
+        break;
+
+      case ReportFormat::JSON: {
+        json::OStream J(outs(), 2);
+        J.object([&] {
+          J.attribute("module", M.getModuleIdentifier());
+          printJSON(J, Total, Counts);
+          J.attributeArray("functions", [&] {
+            for (const FunctionCounts &Row : Rows)
+              J.object([&] {
+                J.attribute("name", Row.F->getName());
+                printJSON(J, Row.Total, Row.Counts);
+              });
+          });
+        });
+        outs() << "\n";
+        break;
+      }
+    }
 
     return PreservedAnalyses::all();
   }
   static bool isRequired() { return true; }
 };
 
+// Parses the parameters of "opcode-count-module<csv;threads=8>". Both are
+// optional; the defaults are text and one thread per core.
+static bool parseModuleOpcodeCount(StringRef Name, ReportFormat &Format,
+                                   unsigned &Threads) {
+  if (!Name.consume_front("opcode-count-module")) return false;
+  Format = ReportFormat::Text;
+  Threads = 0;
+  if (Name.empty()) return true;
+  if (!Name.consume_front("<") || !Name.consume_back(">")) return false;
+
+  SmallVector<StringRef, 2> Params;
+  Name.split(Params, ';', -1, false);
+  for (StringRef Param : Params) {
+    if (Param == "text")
+      Format = ReportFormat::Text;
+    else if (Param == "csv")
+      Format = ReportFormat::CSV;
+    else if (Param == "json")
+      Format = ReportFormat::JSON;
+    else if (!Param.consume_front("threads=") ||
+             Param.getAsInteger(10, Threads))
+      return false;
+  }
+  return true;
+}
+
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
 llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "OpcodeCount", LLVM_VERSION_STRING,
@@ -50,5 +252,15 @@ llvmGetPassPluginInfo() {
                   }
                   return false;
                 });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  ReportFormat Format;
+                  unsigned Threads;
+                  if (!parseModuleOpcodeCount(Name, Format, Threads))
+                    return false;
+                  MPM.addPass(ModuleOpcodeCountPass(Format, Threads));
+                  return true;
+                });
           }};
-}
\ No newline at end of file
+}
@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <string>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/LoopAccessAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char *const PassName = "vectorize-report";
+
+// Tells for every loop whether the loop vectorizer could vectorize it, and
+// if not, why: an unknown trip count, a value carried from one iteration to
+// the next, memory that may overlap, calls, or extra exits. For innermost
+// loops it also estimates from the target's cost model how much faster a
+// vector loop would be, so the report points at the loops that leave SIMD
+// throughput unused. The reasons are emitted as optimization remarks too,
+// for -pass-remarks-analysis=vectorize-report.
+//
+// Run it after mem2reg and loop-rotate, as the loop vectorizer would see
+// the loops.
+class VectorizeReport : public PassInfoMixin<VectorizeReport> {
+ public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    if (LI.empty()) return PreservedAnalyses::all();
+
+    Analyses A{LI,
+               FAM.getResult<ScalarEvolutionAnalysis>(F),
+               FAM.getResult<DominatorTreeAnalysis>(F),
+               FAM.getResult<TargetIRAnalysis>(F),
+               FAM.getResult<TargetLibraryAnalysis>(F),
+               FAM.getResult<LoopAccessAnalysis>(F),
+               FAM.getResult<OptimizationRemarkEmitterAnalysis>(F)};
+
+    std::string Report;
+    raw_string_ostream OS(Report);
+    OS << "Function " << F.getName() << "\n";
+    for (Loop *L : LI.getLoopsInPreorder()) reportLoop(OS, L, A);
+    errs() << OS.str();
+
+    return PreservedAnalyses::all();
+  }
+  static bool isRequired() { return true; }
+
+ private:
+  struct Analyses {
+    LoopInfo &LI;
+    ScalarEvolution &SE;
+    DominatorTree &DT;
+    TargetTransformInfo &TTI;
+    TargetLibraryInfo &TLI;
+    LoopAccessInfoManager &LAIs;
+    OptimizationRemarkEmitter &ORE;
+  };
+
+  // Something found in a loop. Blockers keep it from being vectorized;
+  // notes only change how it is vectorized.
+  struct Finding {
+    const char *Remark;
+    std::string Message;
+    const Instruction *At;
+    bool Blocks;
+  };
+
+  static void printLocation(raw_ostream &OS, Loop *L) {
+    if (DebugLoc Loc = L->getStartLoc())
+      OS << "line " << Loc.getLine();
+    else
+      L->getHeader()->printAsOperand(OS, false);
+  }
+
+  static std::string valueName(const Value &V) {
+    std::string Name;
+    raw_string_ostream OS(Name);
+    V.printAsOperand(OS, false);
+    return OS.str();
+  }
+
+  static std::string lineOf(const Instruction &I) {
+    if (const DebugLoc &Loc = I.getDebugLoc())
+      return " at line " + std::to_string(Loc.getLine());
+    return "";
+  }
+
+  static void reportLoop(raw_ostream &OS, Loop *L, Analyses &A) {
+    OS << "Loop at ";
+    printLocation(OS, L);
+    OS << ", depth " << L->getLoopDepth() << ": ";
+    // The loop vectorizer only widens innermost loops.
+    if (!L->isInnermost()) {
+      OS << "outer loop, its inner loops are reported\n";
+      return;
+    }
+
+    SmallVector<Finding, 8> Findings;
+    checkShape(L, A, Findings);
+    bool HasCalls = checkCalls(L, A, Findings);
+    unsigned ReductionBits = checkRecurrences(L, A, Findings);
+    // Calls that may write memory fail the memory check as well, which
+    // would only repeat them.
+    if (!HasCalls) checkMemory(L, A, Findings);
+
+    bool Vectorizable = llvm::none_of(
+        Findings, [](const Finding &Found) { return Found.Blocks; });
+    OS << (Vectorizable ? "vectorizable" : "not vectorizable") << "\n";
+    for (const Finding &Found : Findings) {
+      OS << "  " << Found.Message << "\n";
+      A.ORE.emit([&] {
+        DebugLoc Loc = Found.At && Found.At->getDebugLoc()
+                           ? Found.At->getDebugLoc()
+                           : L->getStartLoc();
+        return OptimizationRemarkAnalysis(PassName, Found.Remark, Loc,
+                                          L->getHeader())
+               << Found.Message;
+      });
+    }
+
+    Estimate E = estimateSpeedup(L, ReductionBits, A);
+    std::string Summary;
+    raw_string_ostream SummaryOS(Summary);
+    if (E.VF < 2) {
+      SummaryOS << "no vector registers to estimate a speedup with";
+    } else {
+      SummaryOS << format(
+          "estimated speedup %s%.1fx with %u lanes (scalar cost %u, vector "
+          "cost %u per %u iterations)",
+          Vectorizable ? "" : "if fixed ",
+          double(E.VF) * E.ScalarCost / std::max(1u, E.VectorCost), E.VF,
+          E.ScalarCost * E.VF, E.VectorCost, E.VF);
+    }
+    OS << "  " << SummaryOS.str() << "\n";
+    A.ORE.emit([&] {
+      return OptimizationRemarkAnalysis(PassName, "Summary", L->getStartLoc(),
+                                        L->getHeader())
+             << (Vectorizable ? "vectorizable, " : "not vectorizable, ")
+             << SummaryOS.str();
+    });
+  }
+
+  // The vectorizer needs to know the trip count before the loop starts,
+  // and to leave the loop only at the latch.
+  static void checkShape(Loop *L, Analyses &A,
+                         SmallVectorImpl<Finding> &Findings) {
+    BasicBlock *Latch = L->getLoopLatch();
+    if (!L->getExitingBlock())
+      Findings.push_back({"MultipleExits",
+                          "more than one exit; move the early exits out of "
+                          "the loop",
+                          nullptr, true});
+    else if (L->getExitingBlock() != Latch)
+      Findings.push_back({"ExitNotAtLatch",
+                          "the exit test is not at the bottom of the loop; "
+                          "run loop-rotate first",
+                          nullptr, true});
+
+    if (isa<SCEVCouldNotCompute>(A.SE.getBackedgeTakenCount(L))) {
+      Findings.push_back({"UnknownTripCount",
+                          "unknown trip count: the exit condition is not a "
+                          "compare of an induction variable with a value the "
+                          "loop does not change",
+                          Latch ? Latch->getTerminator() : nullptr, true});
+    } else if (unsigned TripCount = A.SE.getSmallConstantTripCount(L)) {
+      Findings.push_back({"TripCount",
+                          "trip count " + std::to_string(TripCount), nullptr,
+                          false});
+    } else {
+      Findings.push_back(
+          {"TripCount", "trip count computed before the loop runs", nullptr,
+           false});
+    }
+  }
+
+  // Calls stay scalar unless they are to intrinsics or library functions
+  // that have vector versions. Returns whether there are such calls.
+  static bool checkCalls(Loop *L, Analyses &A,
+                         SmallVectorImpl<Finding> &Findings) {
+    bool HasCalls = false;
+    for (BasicBlock *BB : L->getBlocks())
+      for (Instruction &I : *BB) {
+        auto *Call = dyn_cast<CallBase>(&I);
+        if (!Call || isa<DbgInfoIntrinsic>(Call) ||
+            isAssumeLikeIntrinsic(Call))
+          continue;
+        auto *CI = dyn_cast<CallInst>(Call);
+        if (CI && getVectorIntrinsicIDForCall(CI, &A.TLI) !=
+                      Intrinsic::not_intrinsic)
+          continue;
+
+        Function *Callee = Call->getCalledFunction();
+        if (Callee && A.TLI.isFunctionVectorizable(Callee->getName()))
+          continue;
+        std::string Name = Callee ? Callee->getName().str() : "a pointer";
+        Findings.push_back({"Call",
+                            "call to " + Name + lineOf(I) +
+                                " has no vector version; inline it or "
+                                "move it out of the loop",
+                            &I, true});
+        HasCalls = true;
+      }
+    return HasCalls;
+  }
+
+  // Every value carried into the next iteration has to be an induction, a
+  // reduction or the previous value of something the loop computes. Returns
+  // the size of the widest reduction, which the vector registers must hold.
+  static unsigned checkRecurrences(Loop *L, Analyses &A,
+                                   SmallVectorImpl<Finding> &Findings) {
+    unsigned ReductionBits = 0;
+    for (PHINode &Phi : L->getHeader()->phis()) {
+      InductionDescriptor Induction;
+      if (InductionDescriptor::isInductionPHI(&Phi, L, &A.SE, Induction))
+        continue;
+
+      RecurrenceDescriptor Reduction;
+      if (RecurrenceDescriptor::isReductionPHI(&Phi, L, Reduction)) {
+        if (Instruction *Exact = Reduction.getExactFPMathInst()) {
+          Findings.push_back(
+              {"FPReduction",
+               "floating-point reduction " + valueName(Phi) + lineOf(*Exact) +
+                   " must keep its order; allow reassociation, e.g. with "
+                   "-ffast-math",
+               Exact, true});
+          continue;
+        }
+        ReductionBits = std::max<unsigned>(
+            ReductionBits, Phi.getType()->getScalarSizeInBits());
+        std::string Operation =
+            RecurrenceDescriptor::isMinMaxRecurrenceKind(
+                Reduction.getRecurrenceKind())
+                ? "min/max"
+                : Reduction.getLoopExitInstr()->getOpcodeName();
+        Findings.push_back({"Reduction",
+                            Operation + " reduction into " + valueName(Phi) +
+                                ", kept as one partial result per lane",
+                            nullptr, false});
+        continue;
+      }
+
+      if (RecurrenceDescriptor::isFixedOrderRecurrence(&Phi, L, &A.DT)) {
+        Findings.push_back({"Recurrence",
+                            valueName(Phi) +
+                                " uses the value of the previous iteration, "
+                                "which costs a shuffle per vector",
+                            nullptr, false});
+        continue;
+      }
+
+      Findings.push_back({"LoopCarried",
+                          "loop-carried dependence through " + valueName(Phi) +
+                              ", which is neither an induction nor a "
+                              "reduction",
+                          &Phi, true});
+    }
+    return ReductionBits;
+  }
+
+  // Loads and stores of different iterations must not overlap, or must be
+  // far enough apart; pointers that may alias are checked at run time.
+  static void checkMemory(Loop *L, Analyses &A,
+                          SmallVectorImpl<Finding> &Findings) {
+    // Loop access analysis needs the trip count too.
+    if (isa<SCEVCouldNotCompute>(A.SE.getBackedgeTakenCount(L)) ||
+        !L->isLoopSimplifyForm())
+      return;
+
+    const LoopAccessInfo &LAI = A.LAIs.getInfo(*L);
+    if (!LAI.canVectorizeMemory()) {
+      std::string Message = "the memory accesses cannot be vectorized";
+      const Instruction *At = nullptr;
+      if (const OptimizationRemarkAnalysis *Report = LAI.getReport()) {
+        Message += ": " + Report->getMsg();
+        At = dyn_cast_or_null<Instruction>(Report->getCodeRegion());
+      }
+      Findings.push_back({"Memory", Message, At, true});
+      return;
+    }
+
+    const RuntimePointerChecking *Checks = LAI.getRuntimePointerChecking();
+    if (Checks && Checks->Need) {
+      unsigned Count = Checks->getNumberOfChecks();
+      Findings.push_back({"Aliasing",
+                          "pointers that may alias need " +
+                              std::to_string(Count) + " run-time check" +
+                              (Count == 1 ? "" : "s") +
+                              "; restrict pointers would remove them",
+                          nullptr, false});
+    }
+
+    const MemoryDepChecker &Deps = LAI.getDepChecker();
+    if (!Deps.isSafeForAnyVectorWidth())
+      Findings.push_back(
+          {"DependenceDistance",
+           "a dependence between iterations limits vectors to " +
+               std::to_string(Deps.getMaxSafeVectorWidthInBits()) + " bits",
+           nullptr, false});
+  }
+
+  struct Estimate {
+    unsigned VF = 0;
+    // Of one scalar iteration and of one vector iteration, which does the
+    // work of VF scalar ones.
+    unsigned ScalarCost = 0;
+    unsigned VectorCost = 0;
+  };
+
+  static unsigned cost(InstructionCost C) {
+    return C.isValid() ? unsigned(*C.getValue()) : 0;
+  }
+
+  // A load or store whose address moves by one element per iteration is
+  // one vector access; others are one scalar access per lane.
+  static bool isConsecutive(Value *Ptr, Type *Ty, Loop *L, Analyses &A) {
+    auto *AddRec = dyn_cast<SCEVAddRecExpr>(A.SE.getSCEV(Ptr));
+    if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine())
+      return false;
+    const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+    auto *Step = dyn_cast<SCEVConstant>(AddRec->getStepRecurrence(A.SE));
+    return Step &&
+           Step->getAPInt() == DL.getTypeStoreSize(Ty).getFixedValue();
+  }
+
+  // A rough model of the loop vectorizer's: every instruction is widened to
+  // VF lanes, where VF fills a vector register with the widest type the
+  // loop loads, stores or reduces. Overheads like run-time checks and the
+  // scalar remainder loop are left out.
+  static Estimate estimateSpeedup(Loop *L, unsigned ReductionBits,
+                                  Analyses &A) {
+    const TargetTransformInfo::TargetCostKind Kind =
+        TargetTransformInfo::TCK_RecipThroughput;
+    Estimate E;
+
+    // Loops that neither access memory nor reduce fall back to the widest
+    // value they compute.
+    unsigned WidestBits = ReductionBits, WidestValueBits = 8;
+    for (BasicBlock *BB : L->getBlocks())
+      for (Instruction &I : *BB) {
+        Type *Ty = I.getType();
+        if (auto *Store = dyn_cast<StoreInst>(&I))
+          Ty = Store->getValueOperand()->getType();
+        if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy()) continue;
+        unsigned Bits = Ty->getScalarSizeInBits();
+        if (isa<LoadInst>(I) || isa<StoreInst>(I))
+          WidestBits = std::max(WidestBits, Bits);
+        WidestValueBits = std::max(WidestValueBits, Bits);
+      }
+    if (!WidestBits) WidestBits = WidestValueBits;
+    unsigned RegisterBits =
+        A.TTI
+            .getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector)
+            .getFixedValue();
+    E.VF = RegisterBits / WidestBits;
+    if (E.VF < 2) return E;
+
+    for (BasicBlock *BB : L->getBlocks())
+      for (Instruction &I : *BB) {
+        unsigned Scalar = cost(A.TTI.getInstructionCost(&I, Kind));
+        E.ScalarCost += Scalar;
+        E.VectorCost += vectorCost(I, Scalar, E.VF, L, A);
+      }
+    return E;
+  }
+
+  static unsigned vectorCost(Instruction &I, unsigned Scalar, unsigned VF,
+                             Loop *L, Analyses &A) {
+    const TargetTransformInfo::TargetCostKind Kind =
+        TargetTransformInfo::TCK_RecipThroughput;
+    TargetTransformInfo &TTI = A.TTI;
+
+    // Control flow, inductions and addresses stay scalar.
+    if (isa<PHINode>(I) || I.isTerminator() || isa<GetElementPtrInst>(I))
+      return Scalar;
+
+    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+      Type *Ty = Load->getType();
+      if (!VectorType::isValidElementType(Ty) ||
+          !isConsecutive(Load->getPointerOperand(), Ty, L, A))
+        return Scalar * VF;
+      return cost(TTI.getMemoryOpCost(
+          Instruction::Load, FixedVectorType::get(Ty, VF), Load->getAlign(),
+          Load->getPointerAddressSpace(), Kind));
+    }
+    if (auto *Store = dyn_cast<StoreInst>(&I)) {
+      Type *Ty = Store->getValueOperand()->getType();
+      if (!VectorType::isValidElementType(Ty) ||
+          !isConsecutive(Store->getPointerOperand(), Ty, L, A))
+        return Scalar * VF;
+      return cost(TTI.getMemoryOpCost(
+          Instruction::Store, FixedVectorType::get(Ty, VF), Store->getAlign(),
+          Store->getPointerAddressSpace(), Kind));
+    }
+
+    Type *Ty = I.getType();
+    if (!VectorType::isValidElementType(Ty)) return Scalar * VF;
+    auto *VecTy = FixedVectorType::get(Ty, VF);
+
+    if (isa<BinaryOperator>(I))
+      return cost(TTI.getArithmeticInstrCost(I.getOpcode(), VecTy, Kind));
+    if (auto *Cmp = dyn_cast<CmpInst>(&I)) {
+      auto *OpTy = FixedVectorType::get(Cmp->getOperand(0)->getType(), VF);
+      return cost(TTI.getCmpSelInstrCost(I.getOpcode(), OpTy, VecTy,
+                                         Cmp->getPredicate(), Kind));
+    }
+    if (auto *Select = dyn_cast<SelectInst>(&I)) {
+      auto *CondTy =
+          FixedVectorType::get(Select->getCondition()->getType(), VF);
+      return cost(TTI.getCmpSelInstrCost(Instruction::Select, VecTy, CondTy,
+                                         CmpInst::BAD_ICMP_PREDICATE, Kind));
+    }
+    if (auto *Cast = dyn_cast<CastInst>(&I)) {
+      Type *SrcTy = Cast->getSrcTy();
+      if (!VectorType::isValidElementType(SrcTy)) return Scalar * VF;
+      return cost(TTI.getCastInstrCost(
+          I.getOpcode(), VecTy, FixedVectorType::get(SrcTy, VF),
+          TargetTransformInfo::CastContextHint::None, Kind));
+    }
+    return Scalar * VF;
+  }
+};
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "VectorizeReport", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "vectorize-report") {
+                    FPM.addPass(VectorizeReport());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
@@ -0,0 +1,37 @@
+int lookup(int key);
+
+// Vectorizable: a reduction over an array.
+int sum(const int *a, int n) {
+  int s = 0;
+  for (int i = 0; i < n; ++i) s += a[i];
+  return s;
+}
+
+// Vectorizable, but a and b may overlap, so it needs run-time checks.
+void add(int *a, const int *b, int n) {
+  for (int i = 0; i < n; ++i) a[i] += b[i];
+}
+
+// Each iteration needs the store of the previous one.
+void prefix(int *a, int n) {
+  for (int i = 1; i < n; ++i) a[i] += a[i - 1];
+}
+
+// The trip count depends on the data.
+int length(const char *s) {
+  int n = 0;
+  while (s[n]) ++n;
+  return n;
+}
+
+// The call has no vector version.
+void translate(int *a, int n) {
+  for (int i = 0; i < n; ++i) a[i] = lookup(a[i]);
+}
+
+// Floating-point adds may not be reordered without -ffast-math.
+float dot(const float *x, const float *y, int n) {
+  float s = 0;
+  for (int i = 0; i < n; ++i) s += x[i] * y[i];
+  return s;
+}
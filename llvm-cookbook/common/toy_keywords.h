@@ -0,0 +1,106 @@
+#ifndef TOY_KEYWORDS_H
+#define TOY_KEYWORDS_H
+
+#include <array>
+#include <string_view>
+
+// Keywords shared by the chapter2 and chapter3 lexers. Each lexer maps them
+// onto its own Token_Type values.
+enum Toy_Keyword {
+  KW_NONE = 0,
+
+  KW_DEF,
+
+  KW_IF,
+  KW_THEN,
+  KW_ELSE,
+
+  KW_FOR,
+  KW_IN,
+
+  KW_BINARY,
+  KW_UNARY,
+
+  KW_VAR,
+
+  KW_COUNT,
+};
+
+struct Keyword_Entry {
+  std::string_view Name;
+  Toy_Keyword Kind = KW_NONE;
+};
+
+inline constexpr Keyword_Entry Keywords[] = {
+    {"def", KW_DEF},       {"if", KW_IF},   {"then", KW_THEN},
+    {"else", KW_ELSE},     {"for", KW_FOR}, {"in", KW_IN},
+    {"binary", KW_BINARY}, {"unary", KW_UNARY}, {"var", KW_VAR},
+};
+
+inline constexpr unsigned KEYWORD_TABLE_SIZE = 32;
+
+constexpr unsigned keyword_hash(std::string_view S, unsigned Multiplier) {
+  return ((unsigned char)S.front() * Multiplier + (unsigned char)S.back() +
+          S.size()) %
+         KEYWORD_TABLE_SIZE;
+}
+
+// Searches for the smallest multiplier that gives every keyword its own slot,
+// so adding a keyword never needs a hand-tuned hash.
+constexpr unsigned find_keyword_multiplier() {
+  for (unsigned Multiplier = 1; Multiplier < 256; ++Multiplier) {
+    bool Used[KEYWORD_TABLE_SIZE] = {};
+    bool Perfect = true;
+    for (const Keyword_Entry &K : Keywords) {
+      unsigned Slot = keyword_hash(K.Name, Multiplier);
+      if (Used[Slot]) {
+        Perfect = false;
+        break;
+      }
+      Used[Slot] = true;
+    }
+    if (Perfect) return Multiplier;
+  }
+  return 0;
+}
+
+inline constexpr unsigned KEYWORD_MULTIPLIER = find_keyword_multiplier();
+static_assert(KEYWORD_MULTIPLIER != 0, "no perfect hash for the keyword set");
+
+constexpr std::array<Keyword_Entry, KEYWORD_TABLE_SIZE> make_keyword_table() {
+  std::array<Keyword_Entry, KEYWORD_TABLE_SIZE> Table{};
+  for (const Keyword_Entry &K : Keywords)
+    Table[keyword_hash(K.Name, KEYWORD_MULTIPLIER)] = K;
+  return Table;
+}
+
+inline constexpr std::array<Keyword_Entry, KEYWORD_TABLE_SIZE> Keyword_Table =
+    make_keyword_table();
+
+constexpr size_t keyword_length(bool Longest) {
+  size_t Length = Keywords[0].Name.size();
+  for (const Keyword_Entry &K : Keywords)
+    if (Longest ? K.Name.size() > Length : K.Name.size() < Length)
+      Length = K.Name.size();
+  return Length;
+}
+
+inline constexpr size_t MIN_KEYWORD_LENGTH = keyword_length(false);
+inline constexpr size_t MAX_KEYWORD_LENGTH = keyword_length(true);
+
+// One hash and at most one string compare per identifier.
+constexpr Toy_Keyword lookup_keyword(std::string_view S) {
+  if (S.size() < MIN_KEYWORD_LENGTH || S.size() > MAX_KEYWORD_LENGTH)
+    return KW_NONE;
+
+  const Keyword_Entry &Entry =
+      Keyword_Table[keyword_hash(S, KEYWORD_MULTIPLIER)];
+  return Entry.Name == S ? Entry.Kind : KW_NONE;
+}
+
+static_assert(lookup_keyword("binary") == KW_BINARY);
+static_assert(lookup_keyword("in") == KW_IN);
+static_assert(lookup_keyword("var") == KW_VAR);
+static_assert(lookup_keyword("fib") == KW_NONE);
+
+#endif  // TOY_KEYWORDS_H